@@ -1,12 +1,29 @@
 #include <windows.h>
+#include <shellapi.h>
 #include <shobjidl.h>
-#include <gdiplus.h>
 #include <vector>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <commctrl.h>
 #include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <filesystem>
+
+#include "ImageEngine.h"
+#include "PaletteQuantizer.h"
+#include "WorkerPool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define COMPRESSOR_SSE2 1
+#endif
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -14,10 +31,13 @@ extern "C" {
 #include <libavutil/opt.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 }
 
-#pragma comment(lib, "gdiplus.lib")
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "avformat.lib")
 #pragma comment(lib, "avcodec.lib")
 #pragma comment(lib, "avutil.lib")
@@ -27,14 +47,836 @@ extern "C" {
 constexpr int MAX_FILES = 10;
 constexpr int WM_COMPRESS_COMPLETE = WM_USER + 1;
 
+// Codec threads are capped at one per this many pixels of picture area, since
+// small frames cannot keep many frame/slice threads busy.
+constexpr int64_t PIXELS_PER_CODEC_THREAD = 128 * 1024;
+constexpr int MAX_CODEC_THREADS = 16;
+
+// Audio is encoded at AUDIO_BITRATE unless it can be copied as is. In
+// target-size planning a share of the budget is held back for container
+// overhead, and a size that leaves less than MIN_VIDEO_BITRATE for the video
+// is rejected.
+constexpr int64_t AUDIO_BITRATE = 128000;
+constexpr double CONTAINER_OVERHEAD = 0.02;
+constexpr int64_t MIN_VIDEO_BITRATE = 64000;
+
+// A planned video bitrate is the encoder's VBV maximum over windows of
+// VBV_BUFFER_SECONDS; its average aims TARGET_RATE_HEADROOM below that.
+constexpr double TARGET_RATE_HEADROOM = 0.05;
+constexpr int64_t VBV_BUFFER_SECONDS = 2;
+
+// Chunk size fed to audio encoders that accept any frame size.
+constexpr int AUDIO_FRAME_SIZE = 1024;
+
+// Resolution ladder for video: below minQuality the picture's short side is
+// scaled down to maxShortSide (0 keeps the source size). Checked in order.
+struct ResolutionStep {
+    int minQuality;
+    int maxShortSide;
+};
+
+constexpr ResolutionStep RESOLUTION_LADDER[] = {
+    { 90, 0 },
+    { 60, 1080 },
+    { 30, 720 },
+    { 0,  480 },
+};
+
+// Duplicate-frame detection, as in ffmpeg's mpdecimate: a frame is a
+// near-duplicate of the last kept one when no 8x8 luma block differs by more
+// than DUPLICATE_BLOCK_HI (sum of absolute differences) and no more than
+// DUPLICATE_BLOCK_FRACTION of the blocks differ by more than DUPLICATE_BLOCK_LO.
+// A frame is still kept at least every DUPLICATE_MAX_HOLD_SECONDS.
+constexpr int DUPLICATE_BLOCK_HI = 64 * 12;
+constexpr int DUPLICATE_BLOCK_LO = 64 * 5;
+constexpr double DUPLICATE_BLOCK_FRACTION = 0.33;
+constexpr int DUPLICATE_MAX_HOLD_SECONDS = 1;
+
+// GIF palettes are built from a histogram of 5-5-5 bit RGB cells. The palette
+// pass samples this many frames spread over the clip, and the median-cut
+// palette is refined by this many k-means iterations. GIF colours are opaque,
+// so alpha carries no weight.
+constexpr int HISTOGRAM_CELLS = 1 << 15;
+constexpr int GIF_PALETTE_SAMPLE_FRAMES = 64;
+constexpr int PALETTE_REFINE_ITERATIONS = 2;
+constexpr double GIF_PALETTE_WEIGHTS[4] = { 1.0, 1.0, 1.0, 0.0 };
+
+// Inputs are stream-copied instead of re-encoded unless re-encoding is
+// expected to save at least this fraction of the video bitrate.
+constexpr double REMUX_MIN_SAVING = 0.10;
+
+// Depth of the queues between CompressVideo pipeline stages. Frame queues are
+// kept short since each entry holds a full uncompressed picture.
+constexpr size_t PACKET_QUEUE_SIZE = 64;
+constexpr size_t FRAME_QUEUE_SIZE = 4;
+
+// Upper bound on idle objects a MediaPool keeps; anything beyond is freed.
+constexpr size_t MAX_POOLED_PACKETS = 256;
+constexpr size_t MAX_POOLED_FRAMES = 32;
+
+// Row alignment of pooled picture buffers, enough for AVX-512 scalers.
+constexpr int PICTURE_ALIGN = 64;
+
+// Idle scaler contexts kept for reuse by later jobs, least recently used first out.
+constexpr size_t MAX_CACHED_SCALERS = 8;
+
+// Segment mode kicks in automatically for videos at least this long, and no
+// segment is made shorter than SEGMENT_MIN_SECONDS.
+constexpr int64_t SEGMENT_AUTO_MIN_SECONDS = 120;
+constexpr int64_t SEGMENT_MIN_SECONDS = 20;
+
+// Each segment encoder gets at least this many of the job's threads, so auto
+// mode only splits jobs with room for two such encoders.
+constexpr unsigned SEGMENT_ENCODER_THREADS = 4;
+
+// Segments being encoded or waiting for the muxer at once. Each one holds a
+// demuxer, decoder and encoder plus its packets, so this bounds memory.
+constexpr size_t MAX_SEGMENTS_IN_FLIGHT = 4;
+
+constexpr int SEGMENT_PENDING = 0;
+constexpr int SEGMENT_DONE = 1;
+constexpr int SEGMENT_FAILED = 2;
+
 enum class FileType { Image, Video, Gif, Unknown };
+enum class GifOutput { Gif, Mp4, WebM, WebP };
+enum class RateControl { ConstantQuality, Bitrate, TargetSize };
+enum class EncoderPreset { Fast, Medium, Slow };
+
+// Per-encoder constant-quality settings. crf holds the CRF used at quality
+// 1, 50, 75 and 100 (interpolated in between), calibrated so the same slider
+// position gives roughly the same visual quality on every encoder, and
+// bitsPerPixel the typical output bitrate per pixel per frame at those CRFs.
+// presets are the encoder's own values for EncoderPreset Fast, Medium, Slow.
+struct EncoderTuning {
+    const char* encoder;
+    const char* crfOption;
+    int crf[4];
+    double bitsPerPixel[4];
+    const char* presetOption;
+    const char* presets[3];
+};
+
+constexpr EncoderTuning ENCODER_TUNINGS[] = {
+    { "libx264",    "crf", { 38, 28, 23, 16 }, { 0.015, 0.040, 0.070, 0.200 }, "preset",   { "veryfast", "medium", "slow" } },
+    { "libx265",    "crf", { 40, 32, 28, 20 }, { 0.010, 0.025, 0.045, 0.130 }, "preset",   { "veryfast", "medium", "slow" } },
+    { "libvpx-vp9", "crf", { 50, 38, 32, 18 }, { 0.010, 0.028, 0.050, 0.140 }, "cpu-used", { "5", "2", "1" } },
+    { "libsvtav1",  "crf", { 52, 40, 35, 20 }, { 0.008, 0.022, 0.040, 0.110 }, "preset",   { "10", "8", "5" } },
+    { "libaom-av1", "crf", { 52, 40, 34, 20 }, { 0.008, 0.022, 0.040, 0.110 }, "cpu-used", { "6", "4", "2" } },
+};
+constexpr int CRF_ANCHOR_QUALITY[4] = { 1, 50, 75, 100 };
 
 struct FileTask {
     std::wstring path;
     std::wstring outputPath;
     FileType type = FileType::Unknown;
     int quality = 75;
-    bool done = false;
+    RateControl rateControl = RateControl::ConstantQuality;
+    EncoderPreset preset = EncoderPreset::Medium;
+    int64_t targetBytes = 0;  // Output size cap for RateControl::TargetSize
+    bool twoPass = true;      // Run an analysis pass first when hitting targetBytes
+    int segments = 0;   // Video slices encoded in parallel: 0 = auto for long inputs, 1 = off
+    int maxWidth = 0;   // Video output size cap in pixels, 0 = none
+    int maxHeight = 0;
+    int maxFps = 0;     // Video output frame-rate cap, 0 = source rate
+    bool dropDuplicateFrames = false; // Skip frames that barely differ from the previous one
+    bool gifLocalPalettes = false;    // One palette per GIF frame instead of one for the clip
+    GifOutput gifOutput = GifOutput::Gif;  // Container GIF inputs are converted to
+    ImageFormat imageFormat = ImageFormat::Unknown;  // Image output format, Unknown = same as the input
+    bool pngQuantize = false;  // Lossy PNG: reduce to a palette sized by quality
+    bool pngDither = true;     // Dither quantised PNGs
+    bool webpLossless = false; // WebP output in libwebp's lossless mode
+    bool jpegProgressive = true;  // Progressive JPEG scans instead of baseline
+    ChromaSubsampling jpegSubsampling = ChromaSubsampling::Auto;  // JPEG chroma, Auto = from content
+    std::vector<ImageFormat> imageCandidates;  // Formats encoded in parallel, smallest kept; overrides imageFormat
+    bool done = false;  // Written only by the worker that ran the task
+};
+
+// Thread counts handed to the codecs and scaler of one decode/encode chain.
+struct CodecThreads {
+    int decoder = 1;
+    int encoder = 1;
+    int scaler = 1;
+};
+
+// Process-wide share-out of codec threads. Each running job holds a JobLease,
+// and codecs opened by a job size their thread pools from the job's current
+// share of the hardware threads. Shares are read when a codec is opened, so
+// codecs opened after other jobs finish pick up the freed threads.
+class ThreadBudget {
+    std::mutex budgetMutex;
+    unsigned totalThreads;
+    unsigned activeJobs = 0;
+
+    ThreadBudget() : totalThreads(WorkerPool::DefaultSize()) {}
+
+public:
+    static ThreadBudget& Instance() {
+        static ThreadBudget budget;
+        return budget;
+    }
+
+    class JobLease {
+    public:
+        JobLease() {
+            ThreadBudget& budget = Instance();
+            std::lock_guard<std::mutex> lock(budget.budgetMutex);
+            ++budget.activeJobs;
+        }
+
+        ~JobLease() {
+            ThreadBudget& budget = Instance();
+            std::lock_guard<std::mutex> lock(budget.budgetMutex);
+            --budget.activeJobs;
+        }
+
+        JobLease(const JobLease&) = delete;
+        JobLease& operator=(const JobLease&) = delete;
+    };
+
+    // Threads one running job may spread over all of its codecs right now.
+    unsigned JobShare() {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        const unsigned jobs = activeJobs > 0 ? activeJobs : 1;
+        return std::max(totalThreads / jobs, 1u);
+    }
+
+    // Splits a share between one decoder, scaler and encoder working on
+    // width x height pictures. The encoder gets whatever the others leave.
+    static CodecThreads Split(unsigned share, int width, int height) {
+        const int64_t pixels = static_cast<int64_t>(std::max(width, 1)) * std::max(height, 1);
+        const int useful = static_cast<int>(std::clamp<int64_t>(pixels / PIXELS_PER_CODEC_THREAD, 1, MAX_CODEC_THREADS));
+        const int total = static_cast<int>(share);
+
+        CodecThreads threads;
+        threads.decoder = std::clamp(total / 4, 1, useful);
+        threads.scaler = std::clamp(total / 8, 1, std::min(useful, 4));
+        threads.encoder = std::clamp(total - threads.decoder - threads.scaler, 1, useful);
+        return threads;
+    }
+};
+
+// Bounded single-producer/single-consumer ring buffer connecting two pipeline
+// stages. Push blocks while the ring is full and Pop while it is empty, using
+// C++20 atomic waits on the indices rather than a mutex. An optional shared
+// signal is bumped on every push so a consumer can wait on several queues.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    T slots[Capacity] = {};
+    alignas(64) std::atomic<size_t> head{ 0 };  // Next slot to pop, owned by the consumer
+    alignas(64) std::atomic<size_t> tail{ 0 };  // Next slot to push, owned by the producer
+    std::atomic<uint32_t>* signal;
+
+public:
+    explicit SpscQueue(std::atomic<uint32_t>* signal = nullptr) : signal(signal) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    void Push(T item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        while (t - h == Capacity) {
+            head.wait(h, std::memory_order_acquire);
+            h = head.load(std::memory_order_acquire);
+        }
+
+        slots[t & (Capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+
+        if (signal) {
+            signal->fetch_add(1, std::memory_order_release);
+            signal->notify_one();
+        }
+    }
+
+    bool TryPop(T& item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h)
+            return false;
+
+        item = slots[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return true;
+    }
+
+    T Pop() {
+        const size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        while (t == h) {
+            tail.wait(t, std::memory_order_acquire);
+            t = tail.load(std::memory_order_acquire);
+        }
+
+        T item = slots[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return item;
+    }
+};
+
+using PacketQueue = SpscQueue<AVPacket*, PACKET_QUEUE_SIZE>;
+using FrameQueue = SpscQueue<AVFrame*, FRAME_QUEUE_SIZE>;
+
+// Free lists of AVPacket and AVFrame objects. Released objects are unreferenced
+// and handed out again, so the per-frame loops stop allocating once a job has
+// warmed up. Each worker thread owns one pool that every job it runs shares;
+// pipeline stages on other threads acquire and release through the job.
+class MediaPool {
+public:
+    static MediaPool& ForThisThread() {
+        thread_local MediaPool pool;
+        return pool;
+    }
+
+    MediaPool() = default;
+    MediaPool(const MediaPool&) = delete;
+    MediaPool& operator=(const MediaPool&) = delete;
+
+    ~MediaPool() {
+        for (auto* pkt : packets)
+            av_packet_free(&pkt);
+        for (auto* frame : frames)
+            av_frame_free(&frame);
+    }
+
+    AVPacket* AcquirePacket() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!packets.empty()) {
+                AVPacket* pkt = packets.back();
+                packets.pop_back();
+                return pkt;
+            }
+        }
+        return av_packet_alloc();
+    }
+
+    AVFrame* AcquireFrame() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!frames.empty()) {
+                AVFrame* frame = frames.back();
+                frames.pop_back();
+                return frame;
+            }
+        }
+        return av_frame_alloc();
+    }
+
+    void Release(AVPacket* pkt) {
+        if (!pkt)
+            return;
+        av_packet_unref(pkt);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (packets.size() < MAX_POOLED_PACKETS) {
+                packets.push_back(pkt);
+                return;
+            }
+        }
+        av_packet_free(&pkt);
+    }
+
+    void Release(AVFrame* frame) {
+        if (!frame)
+            return;
+        av_frame_unref(frame);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (frames.size() < MAX_POOLED_FRAMES) {
+                frames.push_back(frame);
+                return;
+            }
+        }
+        av_frame_free(&frame);
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<AVPacket*> packets;
+    std::vector<AVFrame*> frames;
+};
+
+// Recycled picture buffers of one format and size. Buffers return to the pool
+// when the last reference (possibly held inside an encoder) is dropped.
+class PicturePool {
+public:
+    PicturePool() = default;
+    PicturePool(const PicturePool&) = delete;
+    PicturePool& operator=(const PicturePool&) = delete;
+
+    ~PicturePool() { av_buffer_pool_uninit(&pool); }
+
+    // Gives an empty frame a pooled buffer of the requested format and size.
+    bool Get(AVFrame* frame, AVPixelFormat pixFmt, int w, int h) {
+        if (!pool || pixFmt != format || w != width || h != height) {
+            av_buffer_pool_uninit(&pool);
+            const int size = av_image_get_buffer_size(pixFmt, w, h, PICTURE_ALIGN);
+            if (size < 0)
+                return false;
+            pool = av_buffer_pool_init(size, nullptr);
+            if (!pool)
+                return false;
+            format = pixFmt;
+            width = w;
+            height = h;
+        }
+
+        frame->buf[0] = av_buffer_pool_get(pool);
+        if (!frame->buf[0])
+            return false;
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+        return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+            format, width, height, PICTURE_ALIGN) >= 0;
+    }
+
+private:
+    AVBufferPool* pool = nullptr;
+    AVPixelFormat format = AV_PIX_FMT_NONE;
+    int width = 0;
+    int height = 0;
+};
+
+// Everything an initialised SwsContext depends on; contexts are only reused
+// for an identical key.
+struct ScalerKey {
+    int srcWidth = 0;
+    int srcHeight = 0;
+    AVPixelFormat srcFormat = AV_PIX_FMT_NONE;
+    int dstWidth = 0;
+    int dstHeight = 0;
+    AVPixelFormat dstFormat = AV_PIX_FMT_NONE;
+    unsigned flags = SWS_BILINEAR;
+    int threads = 1;
+
+    bool operator==(const ScalerKey&) const = default;
+};
+
+// Process-wide cache of idle scaler contexts. Initialising one builds filter
+// tables and starts swscale's slice threads, which a batch of same-sized
+// inputs would otherwise repeat per file. A context belongs to one user
+// between Acquire and Release, so no two threads ever scale with it at once.
+class ScalerCache {
+public:
+    static ScalerCache& Instance() {
+        static ScalerCache cache;
+        return cache;
+    }
+
+    ScalerCache(const ScalerCache&) = delete;
+    ScalerCache& operator=(const ScalerCache&) = delete;
+
+    ~ScalerCache() {
+        for (auto& entry : idle)
+            sws_free_context(&entry.ctx);
+    }
+
+    // Returns a cached context for `key`, or a new one; nullptr on failure.
+    SwsContext* Acquire(const ScalerKey& key) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = idle.begin(); it != idle.end(); ++it) {
+                if (it->key == key) {
+                    SwsContext* ctx = it->ctx;
+                    idle.erase(it);
+                    return ctx;
+                }
+            }
+        }
+        return Create(key);
+    }
+
+    void Release(const ScalerKey& key, SwsContext* ctx) {
+        if (!ctx)
+            return;
+
+        SwsContext* evicted = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back({ key, ctx });
+            if (idle.size() > MAX_CACHED_SCALERS) {
+                evicted = idle.front().ctx;
+                idle.pop_front();
+            }
+        }
+        sws_free_context(&evicted);
+    }
+
+private:
+    struct Entry {
+        ScalerKey key;
+        SwsContext* ctx;
+    };
+
+    ScalerCache() = default;
+
+    // swscale splits each picture into horizontal slices across `threads`.
+    static SwsContext* Create(const ScalerKey& key) {
+        SwsContext* swsCtx = sws_alloc_context();
+        if (!swsCtx)
+            return nullptr;
+
+        swsCtx->src_w = key.srcWidth;
+        swsCtx->src_h = key.srcHeight;
+        swsCtx->src_format = key.srcFormat;
+        swsCtx->dst_w = key.dstWidth;
+        swsCtx->dst_h = key.dstHeight;
+        swsCtx->dst_format = key.dstFormat;
+        swsCtx->flags = key.flags;
+        swsCtx->threads = key.threads;
+
+        if (sws_init_context(swsCtx, nullptr, nullptr) < 0) {
+            sws_free_context(&swsCtx);
+            return nullptr;
+        }
+        return swsCtx;
+    }
+
+    std::mutex mutex;
+    std::deque<Entry> idle;
+};
+
+// First-pass rate-control statistics for one encoder. The libx264 wrapper
+// only exchanges them through a file, so it gets a private temp file that is
+// removed again; libvpx and libaom hand them back in memory via stats_out.
+struct TwoPassStats {
+    std::string file;
+    std::string data;
+
+    TwoPassStats() = default;
+    TwoPassStats(const TwoPassStats&) = delete;
+    TwoPassStats& operator=(const TwoPassStats&) = delete;
+
+    bool Ready() const {
+        std::error_code ec;
+        return !data.empty() || (!file.empty() && std::filesystem::exists(file, ec));
+    }
+
+    ~TwoPassStats() {
+        if (!file.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(file, ec);
+            std::filesystem::remove(file + ".mbtree", ec);
+        }
+    }
+};
+
+// One keyframe-aligned slice of the input in segment mode. start/end are
+// video stream timestamps; every segment encoder keeps the source timestamps
+// so their outputs continue the same timeline. The packets stay in the
+// encoder's timeBase until the output header fixes the stream's.
+struct VideoSegment {
+    int64_t start = INT64_MIN;
+    int64_t end = INT64_MAX;
+    std::vector<AVPacket*> packets;
+    AVCodecParameters* parameters = nullptr;
+    AVRational timeBase{ 0, 1 };
+    std::atomic<int> state{ SEGMENT_PENDING };
+
+    ~VideoSegment() {
+        for (auto* pkt : packets)
+            av_packet_free(&pkt);
+        avcodec_parameters_free(&parameters);
+    }
+};
+
+// Demuxer, codec and scaler state for one CompressVideo run.
+struct VideoJob {
+    AVFormatContext* inFmtCtx = nullptr;
+    AVFormatContext* outFmtCtx = nullptr;
+    AVCodecContext* decCtx = nullptr;
+    AVCodecContext* encCtx = nullptr;
+    AVCodecContext* audioDecCtx = nullptr;
+    AVCodecContext* audioEncCtx = nullptr;
+    SwsContext* swsCtx = nullptr;  // Borrowed from ScalerCache under swsKey
+    ScalerKey swsKey;
+    SwrContext* swrCtx = nullptr;
+    AVAudioFifo* audioFifo = nullptr;
+    MediaPool* pool = &MediaPool::ForThisThread();
+    PicturePool pictures;
+    AVStream* outVideoStream = nullptr;
+    AVStream* outAudioStream = nullptr;
+    int videoStreamIdx = -1;
+    int audioStreamIdx = -1;
+    bool copyAudio = false;  // Audio packets are passed through instead of re-encoded
+    CodecThreads threads;
+    std::deque<VideoSegment> segments;  // Planned slices in segment mode, empty for the plain pipeline
+    int64_t targetVideoBitrate = 0;  // Planned bitrate in RateControl::TargetSize, 0 otherwise
+    bool twoPass = false;
+    TwoPassStats stats;
+
+    VideoJob() = default;
+    VideoJob(const VideoJob&) = delete;
+    VideoJob& operator=(const VideoJob&) = delete;
+
+    ~VideoJob() {
+        ScalerCache::Instance().Release(swsKey, swsCtx);
+        avcodec_free_context(&decCtx);
+        if (encCtx)
+            av_freep(&encCtx->stats_in);
+        avcodec_free_context(&encCtx);
+        avcodec_free_context(&audioDecCtx);
+        avcodec_free_context(&audioEncCtx);
+        swr_free(&swrCtx);
+        if (audioFifo) av_audio_fifo_free(audioFifo);
+        avformat_close_input(&inFmtCtx);
+        if (outFmtCtx) {
+            if (!(outFmtCtx->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&outFmtCtx->pb);
+            avformat_free_context(outFmtCtx);
+        }
+    }
+};
+
+// Timing inputs for FrameSelector, all in the input video stream's time base.
+struct FrameSelection {
+    int64_t origin = 0;          // Source timestamp that becomes output pts 0
+    int64_t sourceInterval = 0;  // Nominal source frame duration, 0 if unknown
+    int64_t minInterval = 0;     // Output frame interval for the fps cap, 0 = none
+    int64_t maxHold = 0;         // Longest run of dropped duplicates
+    bool dropDuplicates = false;
+};
+
+// Decides which decoded frames get encoded. Frames that come faster than the
+// fps cap allows, and frames that barely differ from the last kept one, are
+// dropped. Kept frames keep their source timestamps, so the output is
+// variable frame rate and each kept frame lasts until the next one.
+class FrameSelector {
+public:
+    explicit FrameSelector(const FrameSelection& selection)
+        : selection(selection), lastKept(av_frame_alloc()) {}
+
+    FrameSelector(const FrameSelector&) = delete;
+    FrameSelector& operator=(const FrameSelector&) = delete;
+
+    ~FrameSelector() { av_frame_free(&lastKept); }
+
+    // Returns true if `frame` should be encoded, with its output pts in `pts`.
+    bool Select(const AVFrame* frame, int64_t& pts) {
+        int64_t ts = frame->best_effort_timestamp;
+        if (ts == AV_NOPTS_VALUE)
+            ts = lastSeen != AV_NOPTS_VALUE ? lastSeen + std::max<int64_t>(selection.sourceInterval, 1) : selection.origin;
+        lastSeen = ts;
+
+        if (lastKeptTs != AV_NOPTS_VALUE) {
+            // Encoders need strictly increasing pts
+            if (ts <= lastKeptTs)
+                return Drop();
+            if (selection.minInterval > 0 && ts + selection.sourceInterval / 2 < nextSlot)
+                return Drop();
+            if (selection.dropDuplicates && ts - lastKeptTs < selection.maxHold && IsNearDuplicate(lastKept, frame))
+                return Drop();
+        }
+
+        if (selection.minInterval > 0)
+            nextSlot = (lastKeptTs != AV_NOPTS_VALUE && nextSlot + selection.minInterval > ts) ?
+                nextSlot + selection.minInterval : ts + selection.minInterval;
+
+        lastKeptTs = ts;
+        droppedSinceKept = false;
+        av_frame_unref(lastKept);
+        if (lastKept && av_frame_ref(lastKept, frame) < 0)
+            av_frame_unref(lastKept);
+
+        pts = ts - selection.origin;
+        return true;
+    }
+
+    // If the stream ended on dropped frames, references the last kept picture
+    // into `frame` with the pts of the last input frame, so the output keeps
+    // the input's full duration.
+    bool Tail(AVFrame* frame, int64_t& pts) {
+        if (!droppedSinceKept || !lastKept || !lastKept->buf[0] || av_frame_ref(frame, lastKept) < 0)
+            return false;
+        droppedSinceKept = false;
+        pts = lastSeen - selection.origin;
+        return true;
+    }
+
+private:
+    bool Drop() {
+        droppedSinceKept = true;
+        return false;
+    }
+
+    static bool IsNearDuplicate(const AVFrame* a, const AVFrame* b) {
+        if (!a || !a->buf[0] || a->format != b->format || a->width != b->width || a->height != b->height)
+            return false;
+
+        // Only 8-bit planar luma is compared; anything else is always kept
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(a->format));
+        if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+            desc->comp[0].depth != 8 || desc->comp[0].step != 1) {
+            return false;
+        }
+
+        const int blocksX = a->width / 8;
+        const int blocksY = a->height / 8;
+        const int64_t maxChanged = static_cast<int64_t>(DUPLICATE_BLOCK_FRACTION * blocksX * blocksY);
+        int64_t changed = 0;
+
+        for (int by = 0; by < blocksY; ++by) {
+            for (int bx = 0; bx < blocksX; ++bx) {
+                int sad = 0;
+                for (int y = 0; y < 8; ++y) {
+                    const uint8_t* rowA = a->data[0] + (by * 8 + y) * a->linesize[0] + bx * 8;
+                    const uint8_t* rowB = b->data[0] + (by * 8 + y) * b->linesize[0] + bx * 8;
+                    for (int x = 0; x < 8; ++x)
+                        sad += std::abs(rowA[x] - rowB[x]);
+                }
+                if (sad > DUPLICATE_BLOCK_HI)
+                    return false;
+                if (sad > DUPLICATE_BLOCK_LO && ++changed > maxChanged)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    FrameSelection selection;
+    AVFrame* lastKept;
+    int64_t lastKeptTs = AV_NOPTS_VALUE;
+    int64_t lastSeen = AV_NOPTS_VALUE;
+    int64_t nextSlot = 0;
+    bool droppedSinceKept = false;
+};
+
+// Histogram cell of a BGRA pixel read as a little-endian uint32 (0xAARRGGBB).
+inline uint32_t HistogramCell(uint32_t pixel) {
+    return ((pixel >> 9) & 0x7C00) | ((pixel >> 6) & 0x03E0) | ((pixel >> 3) & 0x001F);
+}
+
+// Calls visit(x, cell) for every pixel of a BGRA row, computing four cells
+// per step with SSE2 where available.
+template <typename Visit>
+inline void ForEachHistogramCell(const uint32_t* row, int width, Visit&& visit) {
+    int x = 0;
+#if COMPRESSOR_SSE2
+    const __m128i redMask = _mm_set1_epi32(0x7C00);
+    const __m128i greenMask = _mm_set1_epi32(0x03E0);
+    const __m128i blueMask = _mm_set1_epi32(0x001F);
+    alignas(16) uint32_t cells[4];
+    for (; x + 4 <= width; x += 4) {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+        const __m128i red = _mm_and_si128(_mm_srli_epi32(pixels, 9), redMask);
+        const __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 6), greenMask);
+        const __m128i blue = _mm_and_si128(_mm_srli_epi32(pixels, 3), blueMask);
+        _mm_store_si128(reinterpret_cast<__m128i*>(cells), _mm_or_si128(red, _mm_or_si128(green, blue)));
+        visit(x, cells[0]);
+        visit(x + 1, cells[1]);
+        visit(x + 2, cells[2]);
+        visit(x + 3, cells[3]);
+    }
+#endif
+    for (; x < width; ++x)
+        visit(x, HistogramCell(row[x]));
+}
+
+// Pixel counts per histogram cell, accumulated over BGRA pictures.
+struct ColorHistogram {
+    std::vector<uint32_t> counts = std::vector<uint32_t>(HISTOGRAM_CELLS);
+
+    void Clear() { std::fill(counts.begin(), counts.end(), 0); }
+
+    void Add(const AVFrame* bgra) {
+        for (int y = 0; y < bgra->height; ++y) {
+            const uint32_t* row = reinterpret_cast<const uint32_t*>(bgra->data[0] + y * bgra->linesize[0]);
+            ForEachHistogramCell(row, bgra->width, [&](int, uint32_t cell) { ++counts[cell]; });
+        }
+    }
+};
+
+// Centre colour of a histogram cell.
+inline void CellColor(uint32_t cell, int& r, int& g, int& b) {
+    r = static_cast<int>(((cell >> 10) & 31) << 3 | 4);
+    g = static_cast<int>(((cell >> 5) & 31) << 3 | 4);
+    b = static_cast<int>((cell & 31) << 3 | 4);
+}
+
+// Median cut over the histogram followed by a few k-means passes. Writes up
+// to maxColors opaque 0xAARRGGBB entries to palette and returns the count.
+inline int BuildPalette(const ColorHistogram& histogram, int maxColors, uint32_t* palette) {
+    std::vector<PaletteColor> colors;
+    for (uint32_t cell = 0; cell < HISTOGRAM_CELLS; ++cell) {
+        if (histogram.counts[cell] == 0)
+            continue;
+        int r, g, b;
+        CellColor(cell, r, g, b);
+        colors.push_back({ { double(r), double(g), double(b), 255.0 }, histogram.counts[cell] });
+    }
+
+    const auto centroids = PaletteQuantizer::MedianCut(colors, maxColors, GIF_PALETTE_WEIGHTS, PALETTE_REFINE_ITERATIONS);
+    if (centroids.empty()) {
+        palette[0] = 0xFF000000;
+        return 1;
+    }
+
+    for (size_t i = 0; i < centroids.size(); ++i) {
+        const uint32_t r = static_cast<uint32_t>(std::clamp(std::lround(centroids[i][0]), 0L, 255L));
+        const uint32_t g = static_cast<uint32_t>(std::clamp(std::lround(centroids[i][1]), 0L, 255L));
+        const uint32_t b = static_cast<uint32_t>(std::clamp(std::lround(centroids[i][2]), 0L, 255L));
+        palette[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+    return static_cast<int>(centroids.size());
+}
+
+// Maps BGRA pictures onto a palette. The nearest entry is looked up once per
+// histogram cell and remembered, so most pixels cost one table read.
+class PaletteMapper {
+public:
+    // With reserveTransparent the entry after the colours is left fully
+    // transparent; no pixel maps to it, so encoders can use it for "unchanged".
+    void Reset(const uint32_t* entries, int count, bool reserveTransparent = false) {
+        std::copy(entries, entries + count, palette);
+        std::fill(palette + count, palette + 256, 0xFF000000);
+        if (reserveTransparent && count < 256)
+            palette[count] = 0x00000000;
+        size = count;
+        lut.assign(HISTOGRAM_CELLS, -1);
+    }
+
+    // Fills a PAL8 frame's indices and palette from a BGRA frame of the same size.
+    void Map(const AVFrame* bgra, AVFrame* pal8) {
+        for (int y = 0; y < bgra->height; ++y) {
+            const uint32_t* row = reinterpret_cast<const uint32_t*>(bgra->data[0] + y * bgra->linesize[0]);
+            uint8_t* out = pal8->data[0] + y * pal8->linesize[0];
+            ForEachHistogramCell(row, bgra->width, [&](int x, uint32_t cell) { out[x] = Index(cell); });
+        }
+        std::copy(palette, palette + 256, reinterpret_cast<uint32_t*>(pal8->data[1]));
+    }
+
+private:
+    uint8_t Index(uint32_t cell) {
+        if (lut[cell] >= 0)
+            return static_cast<uint8_t>(lut[cell]);
+
+        int r, g, b;
+        CellColor(cell, r, g, b);
+        int nearest = 0;
+        int nearestDistance = INT32_MAX;
+        for (int i = 0; i < size; ++i) {
+            const int dr = r - static_cast<int>((palette[i] >> 16) & 0xFF);
+            const int dg = g - static_cast<int>((palette[i] >> 8) & 0xFF);
+            const int db = b - static_cast<int>(palette[i] & 0xFF);
+            const int distance = dr * dr + dg * dg + db * db;
+            if (distance < nearestDistance) {
+                nearestDistance = distance;
+                nearest = i;
+            }
+        }
+        lut[cell] = static_cast<int16_t>(nearest);
+        return static_cast<uint8_t>(nearest);
+    }
+
+    uint32_t palette[256] = {};
+    int size = 0;
+    std::vector<int16_t> lut;
 };
 
 class Compressor {
@@ -46,8 +888,9 @@ class Compressor {
     HWND progressBar;
     HWND removeBtn;  // New button
     std::vector<FileTask> tasks;
-    std::mutex taskMutex;
-    ULONG_PTR gdiplusToken;
+    std::atomic<int> completedTasks{ 0 };
+    std::unique_ptr<WorkerPool> pool;
+    FileTask settings;  // Encoding options from the command line, copied into every task
 
     static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp) {
         Compressor* app = reinterpret_cast<Compressor*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
@@ -137,7 +980,7 @@ class Compressor {
             IID_IFileOpenDialog, reinterpret_cast<void**>(&pfd)))) {
 
             COMDLG_FILTERSPEC filters[] = {
-                { L"Media Files", L"*.jpg;*.jpeg;*.png;*.webp;*.gif;*.webm;*.mp4" },
+                { L"Media Files", L"*.jpg;*.jpeg;*.png;*.webp;*.avif;*.gif;*.webm;*.mp4" },
                 { L"All Files", L"*.*" }
             };
             pfd->SetFileTypes(2, filters);
@@ -208,7 +1051,7 @@ class Compressor {
 
         const std::wstring ext = ToLower(path.substr(dotPos));
 
-        if (ext == L".jpg" || ext == L".jpeg" || ext == L".png" || ext == L".webp")
+        if (ext == L".jpg" || ext == L".jpeg" || ext == L".png" || ext == L".webp" || ext == L".avif")
             return FileType::Image;
         if (ext == L".gif")
             return FileType::Gif;
@@ -218,6 +1061,23 @@ class Compressor {
         return FileType::Unknown;
     }
 
+    // Output goes next to the input as <name>_compressed<ext>.
+    FileTask MakeTask(const std::wstring& path, int quality) const {
+        FileTask task = settings;
+        task.path = path;
+        task.quality = quality;
+        task.type = GetFileType(path);
+
+        const size_t dot = path.find_last_of(L'.');
+        if (dot != std::wstring::npos) {
+            task.outputPath = path.substr(0, dot) + L"_compressed" + path.substr(dot);
+        }
+        else {
+            task.outputPath = path + L"_compressed";
+        }
+        return task;
+    }
+
     void StartCompression() {
         const int count = static_cast<int>(SendMessage(listBox, LB_GETCOUNT, 0, 0));
         if (count == 0) return;
@@ -231,95 +1091,103 @@ class Compressor {
             SendMessageW(listBox, LB_GETTEXT, i, reinterpret_cast<LPARAM>(path.data()));
             path.resize(len);
 
-            FileTask task;
-            task.path = path;
-            task.quality = quality;
-            task.type = GetFileType(path);
-
-            const size_t dot = path.find_last_of(L'.');
-            if (dot != std::wstring::npos) {
-                task.outputPath = path.substr(0, dot) + L"_compressed" + path.substr(dot);
-            }
-            else {
-                task.outputPath = path + L"_compressed";
-            }
-
-            tasks.push_back(task);
+            tasks.push_back(MakeTask(path, quality));
         }
 
         SendMessage(progressBar, PBM_SETRANGE, 0, MAKELPARAM(0, count));
         SendMessage(progressBar, PBM_SETPOS, 0, 0);
         EnableWindow(compressBtn, FALSE);
 
-        std::thread([this]() {
-            for (auto& task : tasks) {
-                CompressFile(task);
-                {
-                    std::lock_guard<std::mutex> lock(taskMutex);
-                    task.done = true;
-                }
+        completedTasks = 0;
+
+        // tasks is not resized until the whole batch has completed, so each
+        // job can hold on to its own element for the duration of the run.
+        for (auto& task : tasks) {
+            FileTask* job = &task;
+            pool->Submit([this, job]() {
+                CompressFile(*job);
+                job->done = true;
+                completedTasks.fetch_add(1);
                 PostMessage(hwnd, WM_COMPRESS_COMPLETE, 0, 0);
-            }
-            }).detach();
+                });
+        }
     }
 
-    void CompressFile(FileTask& task) const {
+    bool CompressFile(FileTask& task) const {
+        ThreadBudget::JobLease lease;
+
         switch (task.type) {
         case FileType::Image:
-            CompressImage(task);
-            break;
+            return CompressImage(task);
         case FileType::Video:
-            CompressVideo(task);
-            break;
+            return CompressVideo(task);
         case FileType::Gif:
-            CompressGif(task);
-            break;
+            if (task.gifOutput == GifOutput::Gif)
+                return CompressGif(task);
+            return ConvertGifToVideo(task);
         default:
-            break;
+            return false;
         }
     }
 
-    void CompressImage(const FileTask& task) const {
-        Gdiplus::Bitmap* bmp = Gdiplus::Bitmap::FromFile(task.path.c_str());
-        if (!bmp || bmp->GetLastStatus() != Gdiplus::Ok) {
-            delete bmp;
-            return;
-        }
-
-        CLSID encoderClsid;
-        GetEncoderClsid(L"image/jpeg", &encoderClsid);
+    // Images keep their format (PNG lossless, JPEG, WebP and AVIF at
+    // task.quality) unless task.imageFormat or task.imageCandidates asks for
+    // others; the engine gives the output the extension of what it wrote.
+    bool CompressImage(const FileTask& task) const {
+        ImageOptions options;
+        options.format = task.imageFormat;
+        options.quality = task.quality;
+        options.threads = static_cast<int>(ThreadBudget::Instance().JobShare());
+        options.pool = pool.get();
+        options.quantizePng = task.pngQuantize;
+        options.dither = task.pngDither;
+        options.losslessWebP = task.webpLossless;
+        options.progressiveJpeg = task.jpegProgressive;
+        options.jpegSubsampling = task.jpegSubsampling;
+        options.candidates = task.imageCandidates;
+
+        return ImageEngine::Compress(WideToUtf8(task.path), WideToUtf8(task.outputPath), options);
+    }
 
-        Gdiplus::EncoderParameters params;
-        params.Count = 1;
-        params.Parameter[0].Guid = Gdiplus::EncoderQuality;
-        params.Parameter[0].Type = Gdiplus::EncoderParameterValueTypeLong;
-        params.Parameter[0].NumberOfValues = 1;
-        ULONG quality = task.quality;
-        params.Parameter[0].Value = &quality;
+    static std::wstring ReplaceExtension(const std::wstring& path, const wchar_t* extension) {
+        const size_t dotPos = path.find_last_of(L'.');
+        if (dotPos == std::wstring::npos)
+            return path + extension;
+        return path.substr(0, dotPos) + extension;
+    }
 
-        bmp->Save(task.outputPath.c_str(), &encoderClsid, &params);
-        delete bmp;
+    // Animated GIF to H.264 MP4, VP9 WebM or animated WebP through the video
+    // pipeline; the container picked by the extension selects the encoder.
+    bool ConvertGifToVideo(const FileTask& task) const {
+        FileTask videoTask = task;
+        switch (task.gifOutput) {
+        case GifOutput::Mp4:
+            videoTask.outputPath = ReplaceExtension(task.outputPath, L".mp4");
+            break;
+        case GifOutput::WebM:
+            videoTask.outputPath = ReplaceExtension(task.outputPath, L".webm");
+            break;
+        default:
+            videoTask.outputPath = ReplaceExtension(task.outputPath, L".webp");
+            break;
+        }
+        return CompressVideo(videoTask);
     }
 
-    void CompressGif(const FileTask& task) const {
+    bool CompressGif(const FileTask& task) const {
         // Convert paths to UTF-8
         std::string inputPath = WideToUtf8(task.path);
 
         // Change output extension to .gif
-        std::wstring outputPath = task.outputPath;
-        size_t dotPos = outputPath.find_last_of(L'.');
-        if (dotPos != std::wstring::npos) {
-            outputPath = outputPath.substr(0, dotPos) + L".gif";
-        }
-        std::string outputPathUtf8 = WideToUtf8(outputPath);
+        std::string outputPathUtf8 = WideToUtf8(ReplaceExtension(task.outputPath, L".gif"));
 
         AVFormatContext* inFmtCtx = nullptr;
         if (avformat_open_input(&inFmtCtx, inputPath.c_str(), nullptr, nullptr) < 0)
-            return;
+            return false;
 
         if (avformat_find_stream_info(inFmtCtx, nullptr) < 0) {
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         int videoStreamIdx = -1;
@@ -332,7 +1200,7 @@ class Compressor {
 
         if (videoStreamIdx == -1) {
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         AVStream* inStream = inFmtCtx->streams[videoStreamIdx];
@@ -341,25 +1209,30 @@ class Compressor {
         const AVCodec* decoder = avcodec_find_decoder(inStream->codecpar->codec_id);
         if (!decoder) {
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         AVCodecContext* decCtx = avcodec_alloc_context3(decoder);
         if (!decCtx) {
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         if (avcodec_parameters_to_context(decCtx, inStream->codecpar) < 0) {
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
+        const CodecThreads threads = ThreadBudget::Split(ThreadBudget::Instance().JobShare(),
+            inStream->codecpar->width, inStream->codecpar->height);
+        decCtx->thread_count = threads.decoder;
+        decCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
         if (avcodec_open2(decCtx, decoder, nullptr) < 0) {
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         // Calculate scaled dimensions based on quality
@@ -380,7 +1253,7 @@ class Compressor {
         if (avformat_alloc_output_context2(&outFmtCtx, nullptr, "gif", outputPathUtf8.c_str()) < 0) {
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         // Setup encoder
@@ -389,7 +1262,7 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         AVStream* outStream = avformat_new_stream(outFmtCtx, nullptr);
@@ -397,7 +1270,7 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         AVCodecContext* encCtx = avcodec_alloc_context3(encoder);
@@ -405,13 +1278,18 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         encCtx->width = outWidth;
         encCtx->height = outHeight;
-        // Use RGB8 instead of PAL8 - the GIF encoder can handle this
-        encCtx->pix_fmt = AV_PIX_FMT_RGB8;
+        // Frames are quantized to our own palettes, see BuildGifHistogram
+        encCtx->pix_fmt = AV_PIX_FMT_PAL8;
+
+        // Write each frame as the rectangle that changed since the previous
+        // one, with unchanged pixels inside it set to the palette's
+        // transparent entry so LZW sees long runs
+        av_opt_set(encCtx->priv_data, "gifflags", "+offsetting+transdiff", 0);
 
         // Set proper time base from input stream
         AVRational srcFrameRate = av_guess_frame_rate(inFmtCtx, inStream, nullptr);
@@ -424,14 +1302,13 @@ class Compressor {
         encCtx->time_base = av_make_q(1, 100);
 
         // Reduce frame rate for lower quality settings
-        int targetFps = static_cast<int>(av_q2d(srcFrameRate));
-        if (task.quality < 30 && targetFps > 10) {
-            targetFps = 10;
+        AVRational targetRate = srcFrameRate;
+        if (task.quality < 30 && av_q2d(srcFrameRate) > 10) {
+            targetRate = av_make_q(10, 1);
         }
-        else if (task.quality < 60 && targetFps > 15) {
-            targetFps = 15;
+        else if (task.quality < 60 && av_q2d(srcFrameRate) > 15) {
+            targetRate = av_make_q(15, 1);
         }
-        if (targetFps < 1) targetFps = 1;
 
         if (outFmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
             encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
@@ -441,7 +1318,7 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         if (avcodec_parameters_from_context(outStream->codecpar, encCtx) < 0) {
@@ -449,7 +1326,7 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
         outStream->time_base = encCtx->time_base;
 
@@ -458,7 +1335,7 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         if (avformat_write_header(outFmtCtx, nullptr) < 0) {
@@ -467,14 +1344,13 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
-        // Setup scaler - convert to RGB8 (not PAL8)
-        SwsContext* swsCtx = sws_getContext(
-            decCtx->width, decCtx->height, decCtx->pix_fmt,
-            outWidth, outHeight, AV_PIX_FMT_RGB8,
-            SWS_BILINEAR, nullptr, nullptr, nullptr);
+        // Setup scaler - convert to BGRA, which the palette mapper reads
+        const ScalerKey swsKey = MakeScalerKey(decCtx->width, decCtx->height, decCtx->pix_fmt,
+            outWidth, outHeight, AV_PIX_FMT_BGRA, threads.scaler);
+        SwsContext* swsCtx = ScalerCache::Instance().Acquire(swsKey);
 
         if (!swsCtx) {
             av_write_trailer(outFmtCtx);
@@ -483,20 +1359,27 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
         AVPacket* pkt = av_packet_alloc();
+        AVPacket* encPkt = av_packet_alloc();
         AVFrame* frame = av_frame_alloc();
+        AVFrame* rgbFrame = av_frame_alloc();
         AVFrame* encFrame = av_frame_alloc();
 
-        encFrame->format = AV_PIX_FMT_RGB8;
+        rgbFrame->format = AV_PIX_FMT_BGRA;
+        rgbFrame->width = outWidth;
+        rgbFrame->height = outHeight;
+        encFrame->format = AV_PIX_FMT_PAL8;
         encFrame->width = outWidth;
         encFrame->height = outHeight;
-        if (av_frame_get_buffer(encFrame, 32) < 0) {
-            sws_freeContext(swsCtx);
+        if (av_frame_get_buffer(rgbFrame, 32) < 0 || av_frame_get_buffer(encFrame, 32) < 0) {
+            ScalerCache::Instance().Release(swsKey, swsCtx);
             av_frame_free(&frame);
+            av_frame_free(&rgbFrame);
             av_frame_free(&encFrame);
+            av_packet_free(&encPkt);
             av_packet_free(&pkt);
             av_write_trailer(outFmtCtx);
             avio_closep(&outFmtCtx->pb);
@@ -504,54 +1387,111 @@ class Compressor {
             avformat_free_context(outFmtCtx);
             avcodec_free_context(&decCtx);
             avformat_close_input(&inFmtCtx);
-            return;
+            return false;
         }
 
-        int64_t pts = 0;
-        int frameCount = 0;
-        int inputFrameCount = 0;
+        // One palette for the whole clip from a first pass over sampled frames,
+        // or one per frame if asked for or if the first pass fails
+        const int paletteSize = GifPaletteSize(task.quality);
+        ColorHistogram histogram;
+        PaletteMapper mapper;
+        uint32_t palette[256];
+        const bool globalPalette = !task.gifLocalPalettes &&
+            BuildGifHistogram(inputPath, outWidth, outHeight, targetRate, histogram);
+        if (globalPalette)
+            mapper.Reset(palette, BuildPalette(histogram, paletteSize - 1, palette), true);
+
+        const auto quantizeFrame = [&](const AVFrame* decoded) {
+            sws_scale_frame(swsCtx, rgbFrame, decoded);
+            if (!globalPalette) {
+                histogram.Clear();
+                histogram.Add(rgbFrame);
+                mapper.Reset(palette, BuildPalette(histogram, paletteSize, palette));
+            }
+            mapper.Map(rgbFrame, encFrame);
+        };
+
+        // Select frames by presentation time against the target rate
+        FrameSelection selection;
+        selection.origin = inStream->start_time != AV_NOPTS_VALUE ? inStream->start_time : 0;
+        selection.sourceInterval = av_rescale_q(1, av_inv_q(srcFrameRate), inStream->time_base);
+        selection.minInterval = av_rescale_q(1, av_inv_q(targetRate), inStream->time_base);
+        FrameSelector selector(selection);
+        int64_t lastPts = AV_NOPTS_VALUE;
+
+        // Returns false for frames that are dropped, else their pts in centiseconds
+        const auto selectFrame = [&](const AVFrame* decoded, int64_t& gifPts) {
+            int64_t sourcePts = 0;
+            if (!selector.Select(decoded, sourcePts))
+                return false;
+            gifPts = av_rescale_q(sourcePts, inStream->time_base, encCtx->time_base);
+            if (lastPts != AV_NOPTS_VALUE && gifPts <= lastPts)
+                return false;
+            lastPts = gifPts;
+            return true;
+        };
+
+        // Only the video stream is demuxed. Every GIF frame composites onto
+        // the one before, so all of them are decoded even when most are dropped
+        for (unsigned i = 0; i < inFmtCtx->nb_streams; ++i) {
+            if (static_cast<int>(i) != videoStreamIdx)
+                inFmtCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
 
-        // Calculate frame skip based on input and target fps
-        int srcFps = static_cast<int>(av_q2d(srcFrameRate));
-        if (srcFps < 1) srcFps = 25;
-        int frameSkip = (srcFps > targetFps) ? (srcFps / targetFps) : 1;
-        if (frameSkip < 1) frameSkip = 1;
+        const auto encodeFrame = [&](int64_t framePts) {
+            encFrame->pts = framePts;
+            if (avcodec_send_frame(encCtx, encFrame) >= 0) {
+                while (avcodec_receive_packet(encCtx, encPkt) >= 0) {
+                    encPkt->stream_index = outStream->index;
+                    av_interleaved_write_frame(outFmtCtx, encPkt);
+                    av_packet_unref(encPkt);
+                }
+            }
+        };
+
+        // A frame identical to the previous one is not sent at all, which
+        // lengthens the previous frame's delay. Only with the global palette,
+        // where equal indices mean equal colours.
+        std::vector<uint8_t> lastIndices;
+        int64_t repeatedPts = AV_NOPTS_VALUE;
+        const auto isRepeat = [&](int64_t framePts) {
+            if (!globalPalette)
+                return false;
+
+            const size_t rowBytes = static_cast<size_t>(outWidth);
+            bool same = !lastIndices.empty();
+            for (int y = 0; same && y < outHeight; ++y)
+                same = memcmp(encFrame->data[0] + y * encFrame->linesize[0], &lastIndices[y * rowBytes], rowBytes) == 0;
+
+            if (same) {
+                repeatedPts = framePts;
+                return true;
+            }
 
-        // Calculate pts increment for proper timing (in centiseconds)
-        int ptsIncrement = 100 / targetFps;
-        if (ptsIncrement < 1) ptsIncrement = 1;
+            lastIndices.resize(rowBytes * outHeight);
+            for (int y = 0; y < outHeight; ++y)
+                memcpy(&lastIndices[y * rowBytes], encFrame->data[0] + y * encFrame->linesize[0], rowBytes);
+            repeatedPts = AV_NOPTS_VALUE;
+            return false;
+        };
 
-        while (av_read_frame(inFmtCtx, pkt) >= 0) {
+        int64_t pts = 0;
+
+        while (av_read_frame(inFmtCtx, pkt) >= 0) {
             if (pkt->stream_index == videoStreamIdx) {
                 int sendRet = avcodec_send_packet(decCtx, pkt);
                 if (sendRet >= 0) {
                     while (avcodec_receive_frame(decCtx, frame) >= 0) {
-                        inputFrameCount++;
-
                         // Skip frames based on quality setting
-                        if ((inputFrameCount - 1) % frameSkip != 0)
+                        if (!selectFrame(frame, pts))
                             continue;
 
                         if (av_frame_make_writable(encFrame) < 0)
                             continue;
 
-                        sws_scale(swsCtx, frame->data, frame->linesize, 0, decCtx->height,
-                            encFrame->data, encFrame->linesize);
-
-                        encFrame->pts = pts;
-                        pts += ptsIncrement;
-                        frameCount++;
-
-                        int encSendRet = avcodec_send_frame(encCtx, encFrame);
-                        if (encSendRet >= 0) {
-                            AVPacket* encPkt = av_packet_alloc();
-                            while (avcodec_receive_packet(encCtx, encPkt) >= 0) {
-                                encPkt->stream_index = outStream->index;
-                                av_interleaved_write_frame(outFmtCtx, encPkt);
-                                av_packet_unref(encPkt);
-                            }
-                            av_packet_free(&encPkt);
-                        }
+                        quantizeFrame(frame);
+                        if (!isRepeat(pts))
+                            encodeFrame(pts);
                     }
                 }
             }
@@ -561,54 +1501,137 @@ class Compressor {
         // Flush decoder
         avcodec_send_packet(decCtx, nullptr);
         while (avcodec_receive_frame(decCtx, frame) >= 0) {
-            inputFrameCount++;
-
-            if ((inputFrameCount - 1) % frameSkip != 0)
+            if (!selectFrame(frame, pts))
                 continue;
 
             if (av_frame_make_writable(encFrame) < 0)
                 continue;
 
-            sws_scale(swsCtx, frame->data, frame->linesize, 0, decCtx->height,
-                encFrame->data, encFrame->linesize);
-
-            encFrame->pts = pts;
-            pts += ptsIncrement;
-            frameCount++;
-
-            if (avcodec_send_frame(encCtx, encFrame) >= 0) {
-                AVPacket* encPkt = av_packet_alloc();
-                while (avcodec_receive_packet(encCtx, encPkt) >= 0) {
-                    encPkt->stream_index = outStream->index;
-                    av_interleaved_write_frame(outFmtCtx, encPkt);
-                    av_packet_unref(encPkt);
-                }
-                av_packet_free(&encPkt);
-            }
+            quantizeFrame(frame);
+            if (!isRepeat(pts))
+                encodeFrame(pts);
         }
 
+        // Keep the clip's full length if it ended on repeated frames; the
+        // encoder reduces the repeat to a tiny transparent rectangle
+        if (repeatedPts != AV_NOPTS_VALUE)
+            encodeFrame(repeatedPts);
+
         // Flush encoder
         avcodec_send_frame(encCtx, nullptr);
-        AVPacket* encPkt = av_packet_alloc();
         while (avcodec_receive_packet(encCtx, encPkt) >= 0) {
             encPkt->stream_index = outStream->index;
             av_interleaved_write_frame(outFmtCtx, encPkt);
             av_packet_unref(encPkt);
         }
-        av_packet_free(&encPkt);
 
-        av_write_trailer(outFmtCtx);
+        const bool written = av_write_trailer(outFmtCtx) >= 0;
 
         // Cleanup
-        sws_freeContext(swsCtx);
+        ScalerCache::Instance().Release(swsKey, swsCtx);
         av_frame_free(&frame);
+        av_frame_free(&rgbFrame);
         av_frame_free(&encFrame);
+        av_packet_free(&encPkt);
         av_packet_free(&pkt);
         avcodec_free_context(&decCtx);
         avcodec_free_context(&encCtx);
         avformat_close_input(&inFmtCtx);
         avio_closep(&outFmtCtx->pb);
         avformat_free_context(outFmtCtx);
+        return written;
+    }
+
+    // Palette size for GIF output: fewer colours at lower quality, which
+    // compresses better under LZW.
+    static int GifPaletteSize(int quality) {
+        return std::clamp(32 + quality * 224 / 100, 32, 256);
+    }
+
+    // First GIF pass: decodes about GIF_PALETTE_SAMPLE_FRAMES frames spread
+    // over the clip (never more often than the output rate), scales them to
+    // the output size and adds them to `histogram`.
+    static bool BuildGifHistogram(const std::string& inputPath, int width, int height, AVRational outputRate,
+        ColorHistogram& histogram) {
+        VideoJob job;
+        if (!OpenVideoInput(inputPath, ThreadBudget::Instance().JobShare(), job))
+            return false;
+
+        AVStream* inStream = job.inFmtCtx->streams[job.videoStreamIdx];
+        for (unsigned i = 0; i < job.inFmtCtx->nb_streams; ++i) {
+            if (static_cast<int>(i) != job.videoStreamIdx)
+                job.inFmtCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        int64_t duration = inStream->duration;
+        if (duration == AV_NOPTS_VALUE || duration <= 0) {
+            duration = job.inFmtCtx->duration != AV_NOPTS_VALUE ?
+                av_rescale_q(job.inFmtCtx->duration, AV_TIME_BASE_Q, inStream->time_base) : 0;
+        }
+
+        FrameSelection selection;
+        selection.origin = inStream->start_time != AV_NOPTS_VALUE ? inStream->start_time : 0;
+        selection.minInterval = std::max(av_rescale_q(1, av_inv_q(outputRate), inStream->time_base),
+            duration / GIF_PALETTE_SAMPLE_FRAMES);
+        FrameSelector selector(selection);
+
+        job.swsKey = MakeScalerKey(job.decCtx->width, job.decCtx->height, job.decCtx->pix_fmt,
+            width, height, AV_PIX_FMT_BGRA, job.threads.scaler);
+        job.swsCtx = ScalerCache::Instance().Acquire(job.swsKey);
+        if (!job.swsCtx)
+            return false;
+
+        AVPacket* pkt = job.pool->AcquirePacket();
+        AVFrame* frame = job.pool->AcquireFrame();
+        AVFrame* bgra = job.pool->AcquireFrame();
+        bool ok = pkt && frame && bgra;
+        bool sampled = false;
+        bool inputDone = false;
+
+        while (ok && !inputDone) {
+            const int readRet = av_read_frame(job.inFmtCtx, pkt);
+            if (readRet >= 0 && pkt->stream_index != job.videoStreamIdx) {
+                av_packet_unref(pkt);
+                continue;
+            }
+
+            inputDone = (readRet < 0);
+            avcodec_send_packet(job.decCtx, inputDone ? nullptr : pkt);
+            av_packet_unref(pkt);
+
+            while (avcodec_receive_frame(job.decCtx, frame) == 0) {
+                int64_t pts = 0;
+                if (selector.Select(frame, pts)) {
+                    av_frame_unref(bgra);
+                    if (job.pictures.Get(bgra, AV_PIX_FMT_BGRA, width, height) &&
+                        sws_scale_frame(job.swsCtx, bgra, frame) >= 0) {
+                        histogram.Add(bgra);
+                        sampled = true;
+                    }
+                }
+                av_frame_unref(frame);
+            }
+        }
+
+        job.pool->Release(bgra);
+        job.pool->Release(frame);
+        job.pool->Release(pkt);
+        return ok && sampled;
+    }
+
+    // Scaler for the frame API; sws_scale_frame splits the work over `threads`.
+    static ScalerKey MakeScalerKey(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
+        int dstWidth, int dstHeight, AVPixelFormat dstFormat, int threads) {
+        ScalerKey key;
+        key.srcWidth = srcWidth;
+        key.srcHeight = srcHeight;
+        key.srcFormat = srcFormat;
+        key.dstWidth = dstWidth;
+        key.dstHeight = dstHeight;
+        key.dstFormat = dstFormat;
+        key.flags = SWS_BILINEAR;
+        key.threads = threads;
+        return key;
     }
 
     static std::string WideToUtf8(const std::wstring& wide) {
@@ -620,240 +1643,1627 @@ class Compressor {
         return result;
     }
 
-    void CompressVideo(const FileTask& task) const {
-        std::string inputPath = WideToUtf8(task.path);
-        std::string outputPath = WideToUtf8(task.outputPath);
+    // Opens the demuxer and the decoder for the first video stream; the first
+    // audio stream index is recorded but its decoder is left to the caller.
+    // threadShare is split between the decoder, scaler and encoder of the job.
+    static bool OpenVideoInput(const std::string& inputPath, unsigned threadShare, VideoJob& job) {
+        if (avformat_open_input(&job.inFmtCtx, inputPath.c_str(), nullptr, nullptr) < 0)
+            return false;
 
-        AVFormatContext* inFmtCtx = nullptr;
-        if (avformat_open_input(&inFmtCtx, inputPath.c_str(), nullptr, nullptr) < 0)
-            return;
+        if (avformat_find_stream_info(job.inFmtCtx, nullptr) < 0)
+            return false;
 
-        if (avformat_find_stream_info(inFmtCtx, nullptr) < 0) {
-            avformat_close_input(&inFmtCtx);
-            return;
+        for (unsigned i = 0; i < job.inFmtCtx->nb_streams; ++i) {
+            if (job.inFmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && job.videoStreamIdx == -1) {
+                job.videoStreamIdx = i;
+            }
+            else if (job.inFmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && job.audioStreamIdx == -1) {
+                job.audioStreamIdx = i;
+            }
         }
 
-        int videoStreamIdx = -1;
-        int audioStreamIdx = -1;
+        if (job.videoStreamIdx == -1)
+            return false;
 
-        for (unsigned i = 0; i < inFmtCtx->nb_streams; ++i) {
-            if (inFmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStreamIdx == -1) {
-                videoStreamIdx = i;
+        AVStream* inVideoStream = job.inFmtCtx->streams[job.videoStreamIdx];
+        const AVCodec* decoder = avcodec_find_decoder(inVideoStream->codecpar->codec_id);
+        if (!decoder)
+            return false;
+
+        job.decCtx = avcodec_alloc_context3(decoder);
+        if (!job.decCtx)
+            return false;
+        if (avcodec_parameters_to_context(job.decCtx, inVideoStream->codecpar) < 0)
+            return false;
+
+        job.threads = ThreadBudget::Split(threadShare, inVideoStream->codecpar->width, inVideoStream->codecpar->height);
+        job.decCtx->thread_count = job.threads.decoder;
+        job.decCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        if (avcodec_open2(job.decCtx, decoder, nullptr) < 0)
+            return false;
+
+        return true;
+    }
+
+    // Configures and opens the video encoder for job's decoded stream. Every
+    // encoder of one file goes through here, so segment encoders stay identical.
+    // pass is 0 for a single-pass encode, or 1/2 for the halves of a two-pass
+    // encode sharing `stats`.
+    static bool OpenVideoEncoder(const FileTask& task, const VideoJob& job, const AVOutputFormat* outFormat,
+        AVCodecContext*& encCtx, int pass = 0, TwoPassStats* stats = nullptr) {
+        const AVCodec* encoder = SelectVideoEncoder(outFormat);
+        if (!encoder)
+            return false;
+
+        encCtx = avcodec_alloc_context3(encoder);
+        if (!encCtx)
+            return false;
+
+        AVStream* inVideoStream = job.inFmtCtx->streams[job.videoStreamIdx];
+        PlanVideoSize(task, job.decCtx->width, job.decCtx->height, encCtx->width, encCtx->height);
+        encCtx->sample_aspect_ratio = job.decCtx->sample_aspect_ratio;
+        // Frames keep their source timestamps, so the encoder works in the stream's time base
+        encCtx->time_base = inVideoStream->time_base;
+        encCtx->framerate = PlanOutputFrameRate(task, job);
+        encCtx->pix_fmt = SelectVideoPixelFormat(encoder, job.decCtx->pix_fmt);
+        encCtx->thread_count = job.threads.encoder;
+        encCtx->thread_type = FF_THREAD_FRAME;
+        ApplyRateControl(task, job, encCtx);
+
+        if (pass == 1)
+            encCtx->flags |= AV_CODEC_FLAG_PASS1;
+        else if (pass == 2)
+            encCtx->flags |= AV_CODEC_FLAG_PASS2;
+
+        if (pass != 0 && stats) {
+            if (!stats->file.empty()) {
+                av_opt_set(encCtx->priv_data, "stats", stats->file.c_str(), 0);
             }
-            else if (inFmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStreamIdx == -1) {
-                audioStreamIdx = i;
+            else if (pass == 2) {
+                encCtx->stats_in = av_strdup(stats->data.c_str());
+                if (!encCtx->stats_in)
+                    return false;
             }
         }
 
-        if (videoStreamIdx == -1) {
-            avformat_close_input(&inFmtCtx);
-            return;
+        if (outFormat->flags & AVFMT_GLOBALHEADER)
+            encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+        return avcodec_open2(encCtx, encoder, nullptr) >= 0;
+    }
+
+    // First encoder from `names` that is available and accepted by the output
+    // container, falling back to the container's default codec.
+    static const AVCodec* SelectEncoder(const AVOutputFormat* outFormat, std::initializer_list<const char*> names,
+        AVCodecID fallback) {
+        for (const char* name : names) {
+            const AVCodec* codec = avcodec_find_encoder_by_name(name);
+            if (codec && avformat_query_codec(outFormat, codec->id, FF_COMPLIANCE_NORMAL) == 1)
+                return codec;
         }
+        return fallback != AV_CODEC_ID_NONE ? avcodec_find_encoder(fallback) : nullptr;
+    }
 
-        const AVCodec* decoder = avcodec_find_decoder(inFmtCtx->streams[videoStreamIdx]->codecpar->codec_id);
-        if (!decoder) {
-            avformat_close_input(&inFmtCtx);
-            return;
+    // libx265 stands in for libx264 in MP4 when a build only has the former.
+    static const AVCodec* SelectVideoEncoder(const AVOutputFormat* outFormat) {
+        return SelectEncoder(outFormat,
+            { "libx264", "libx265", "libvpx-vp9", "libsvtav1", "libaom-av1", "libwebp_anim" },
+            outFormat->video_codec);
+    }
+
+    static const AVCodec* SelectAudioEncoder(const AVOutputFormat* outFormat) {
+        return SelectEncoder(outFormat, { "aac", "libopus", "libvorbis" }, outFormat->audio_codec);
+    }
+
+    // Sets up `stats` for a two-pass encode with `encoder`, or returns false if
+    // the encoder's wrapper cannot carry first-pass statistics.
+    static bool PrepareTwoPass(const AVCodec* encoder, TwoPassStats& stats) {
+        if (strcmp(encoder->name, "libx264") == 0) {
+            static std::atomic<unsigned> statsCounter{ 0 };
+            std::error_code ec;
+            const std::filesystem::path dir = std::filesystem::temp_directory_path(ec);
+            if (ec)
+                return false;
+            const std::string name = "compressor_" + std::to_string(GetCurrentProcessId()) + "_" +
+                std::to_string(statsCounter.fetch_add(1)) + ".log";
+            stats.file = (dir / name).string();
+            return true;
         }
 
-        AVCodecContext* decCtx = avcodec_alloc_context3(decoder);
-        avcodec_parameters_to_context(decCtx, inFmtCtx->streams[videoStreamIdx]->codecpar);
-        avcodec_open2(decCtx, decoder, nullptr);
+        return strcmp(encoder->name, "libvpx-vp9") == 0 || strcmp(encoder->name, "libvpx") == 0 ||
+            strcmp(encoder->name, "libaom-av1") == 0;
+    }
+
+    // True if the input's audio already uses the codec we would encode to, at no
+    // more than AUDIO_BITRATE, so its packets can go to the output unchanged.
+    static bool CanCopyAudio(const VideoJob& job) {
+        if (job.audioStreamIdx == -1)
+            return false;
+
+        const AVCodecParameters* audioPar = job.inFmtCtx->streams[job.audioStreamIdx]->codecpar;
+        const AVCodec* audioEncoder = SelectAudioEncoder(job.outFmtCtx->oformat);
+        return audioEncoder && audioEncoder->id == audioPar->codec_id &&
+            audioPar->bit_rate > 0 && audioPar->bit_rate <= AUDIO_BITRATE;
+    }
+
+    // The encoder's own rate if it supports the input's, otherwise the closest one it does.
+    static int SelectSampleRate(const AVCodec* encoder, int preferred) {
+        const int* rates = nullptr;
+        int count = 0;
+        if (avcodec_get_supported_config(nullptr, encoder, AV_CODEC_CONFIG_SAMPLE_RATE,
+            0, (const void**)&rates, &count) < 0 || !rates || count == 0) {
+            return preferred;
+        }
+
+        int best = rates[0];
+        for (int i = 0; i < count; ++i) {
+            if (rates[i] == preferred)
+                return preferred;
+            if (std::abs(rates[i] - preferred) < std::abs(best - preferred))
+                best = rates[i];
+        }
+        return best;
+    }
 
-        AVCodecContext* audioDecCtx = nullptr;
-        if (audioStreamIdx != -1) {
-            const AVCodec* audioDecoder = avcodec_find_decoder(inFmtCtx->streams[audioStreamIdx]->codecpar->codec_id);
+    // The input's layout if the encoder accepts it, otherwise the encoder's
+    // layout with the nearest channel count.
+    static void SelectChannelLayout(const AVCodec* encoder, const AVChannelLayout& preferred, AVChannelLayout* layout) {
+        AVChannelLayout wanted{};
+        if (preferred.order == AV_CHANNEL_ORDER_UNSPEC || !av_channel_layout_check(&preferred))
+            av_channel_layout_default(&wanted, std::max(preferred.nb_channels, 1));
+        else
+            av_channel_layout_copy(&wanted, &preferred);
+
+        const AVChannelLayout* layouts = nullptr;
+        int count = 0;
+        const AVChannelLayout* best = &wanted;
+        if (avcodec_get_supported_config(nullptr, encoder, AV_CODEC_CONFIG_CHANNEL_LAYOUT,
+            0, (const void**)&layouts, &count) >= 0 && layouts && count > 0) {
+            best = &layouts[0];
+            for (int i = 0; i < count; ++i) {
+                if (av_channel_layout_compare(&layouts[i], &wanted) == 0) {
+                    best = &layouts[i];
+                    break;
+                }
+                if (std::abs(layouts[i].nb_channels - wanted.nb_channels) < std::abs(best->nb_channels - wanted.nb_channels))
+                    best = &layouts[i];
+            }
+        }
+
+        av_channel_layout_copy(layout, best);
+        av_channel_layout_uninit(&wanted);
+    }
+
+    static int AudioFrameSize(const AVCodecContext* encCtx) {
+        if (encCtx->frame_size > 0 && !(encCtx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+            return encCtx->frame_size;
+        return AUDIO_FRAME_SIZE;
+    }
+
+    static int64_t OutputAudioBitrate(const VideoJob& job) {
+        if (job.copyAudio)
+            return job.inFmtCtx->streams[job.audioStreamIdx]->codecpar->bit_rate;
+        return job.audioDecCtx ? AUDIO_BITRATE : 0;
+    }
+
+    // Splits task.targetBytes over the input's duration after reserving the
+    // audio track and the container overhead. Returns 0 if the duration is
+    // unknown or the size leaves less than MIN_VIDEO_BITRATE for the video.
+    static int64_t PlanTargetVideoBitrate(const FileTask& task, const VideoJob& job) {
+        if (task.targetBytes <= 0)
+            return 0;
+
+        int64_t duration = job.inFmtCtx->duration;
+        if (duration == AV_NOPTS_VALUE || duration <= 0) {
+            const AVStream* inVideoStream = job.inFmtCtx->streams[job.videoStreamIdx];
+            if (inVideoStream->duration == AV_NOPTS_VALUE || inVideoStream->duration <= 0)
+                return 0;
+            duration = av_rescale_q(inVideoStream->duration, inVideoStream->time_base, AV_TIME_BASE_Q);
+        }
+
+        const double seconds = static_cast<double>(duration) / AV_TIME_BASE;
+        const double totalBits = task.targetBytes * 8.0 * (1.0 - CONTAINER_OVERHEAD);
+        const double audioBits = OutputAudioBitrate(job) * seconds;
+        const int64_t bitrate = static_cast<int64_t>((totalBits - audioBits) / seconds);
+        return bitrate >= MIN_VIDEO_BITRATE ? bitrate : 0;
+    }
+
+    static const EncoderTuning* FindEncoderTuning(const AVCodec* encoder) {
+        for (const auto& tuning : ENCODER_TUNINGS) {
+            if (strcmp(tuning.encoder, encoder->name) == 0)
+                return &tuning;
+        }
+        return nullptr;
+    }
+
+    // Linear interpolation of a per-encoder table sampled at CRF_ANCHOR_QUALITY.
+    template <typename T>
+    static double InterpolateQuality(const T (&points)[4], int quality) {
+        quality = std::clamp(quality, CRF_ANCHOR_QUALITY[0], CRF_ANCHOR_QUALITY[3]);
+        for (int i = 1; i < 4; ++i) {
+            if (quality <= CRF_ANCHOR_QUALITY[i]) {
+                const double t = static_cast<double>(quality - CRF_ANCHOR_QUALITY[i - 1]) /
+                    (CRF_ANCHOR_QUALITY[i] - CRF_ANCHOR_QUALITY[i - 1]);
+                return points[i - 1] + t * (points[i] - points[i - 1]);
+            }
+        }
+        return points[3];
+    }
+
+    static int QualityToCrf(const EncoderTuning& tuning, int quality) {
+        return static_cast<int>(std::lround(InterpolateQuality(tuning.crf, quality)));
+    }
+
+    // Bitrate mode (and uncalibrated encoders) scale the source's bitrate.
+    static int64_t SourceScaledBitrate(const FileTask& task, const VideoJob& job) {
+        return job.decCtx->bit_rate > 0 ? (int64_t)(job.decCtx->bit_rate * (task.quality / 100.0)) : 2000000;
+    }
+
+    // A planned target bitrate wins; otherwise constant quality is used
+    // whenever the encoder has a CRF calibration, and the bitrate scales with
+    // the source's in Bitrate mode or for uncalibrated encoders.
+    static void ApplyRateControl(const FileTask& task, const VideoJob& job, AVCodecContext* encCtx) {
+        const EncoderTuning* tuning = FindEncoderTuning(encCtx->codec);
+
+        if (tuning) {
+            av_opt_set(encCtx->priv_data, tuning->presetOption,
+                tuning->presets[static_cast<int>(task.preset)], 0);
+        }
+
+        if (job.targetVideoBitrate > 0) {
+            // The VBV holds single-pass ABR, which otherwise drifts past
+            // its average, to the cap
+            encCtx->bit_rate = static_cast<int64_t>(job.targetVideoBitrate * (1.0 - TARGET_RATE_HEADROOM));
+            encCtx->rc_max_rate = job.targetVideoBitrate;
+            encCtx->rc_buffer_size = static_cast<int>(std::min<int64_t>(
+                job.targetVideoBitrate * VBV_BUFFER_SECONDS, INT_MAX));
+        }
+        else if (task.rateControl != RateControl::Bitrate && tuning) {
+            encCtx->bit_rate = 0;
+            av_opt_set_int(encCtx->priv_data, tuning->crfOption, QualityToCrf(*tuning, task.quality), 0);
+        }
+        else if (strncmp(encCtx->codec->name, "libwebp", 7) == 0) {
+            // libwebp has no bitrate control, only its own 0-100 quality
+            encCtx->global_quality = task.quality * FF_QP2LAMBDA;
+        }
+        else {
+            encCtx->bit_rate = SourceScaledBitrate(task, job);
+        }
+    }
+
+    // 4:2:0, with an alpha plane when the source has transparency (as GIFs
+    // often do) and the encoder can store it, e.g. VP9 and WebP.
+    static AVPixelFormat SelectVideoPixelFormat(const AVCodec* encoder, AVPixelFormat sourceFormat) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(sourceFormat);
+        if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_ALPHA))
+            return AV_PIX_FMT_YUV420P;
+
+        const enum AVPixelFormat* formats = nullptr;
+        int count = 0;
+        if (avcodec_get_supported_config(nullptr, encoder, AV_CODEC_CONFIG_PIX_FORMAT,
+            0, (const void**)&formats, &count) >= 0 && formats) {
+            for (int i = 0; i < count; ++i) {
+                if (formats[i] == AV_PIX_FMT_YUVA420P)
+                    return AV_PIX_FMT_YUVA420P;
+            }
+        }
+        return AV_PIX_FMT_YUV420P;
+    }
+
+    // Output picture size: the source scaled down by the resolution ladder for
+    // task.quality and by the task's max width/height, keeping the aspect
+    // ratio, with even dimensions as 4:2:0 encoders require.
+    static void PlanVideoSize(const FileTask& task, int srcWidth, int srcHeight, int& width, int& height) {
+        double scale = 1.0;
+
+        for (const auto& step : RESOLUTION_LADDER) {
+            if (task.quality < step.minQuality)
+                continue;
+            const int shortSide = std::min(srcWidth, srcHeight);
+            if (step.maxShortSide > 0 && shortSide > step.maxShortSide)
+                scale = static_cast<double>(step.maxShortSide) / shortSide;
+            break;
+        }
+
+        if (task.maxWidth > 0 && srcWidth * scale > task.maxWidth)
+            scale = static_cast<double>(task.maxWidth) / srcWidth;
+        if (task.maxHeight > 0 && srcHeight * scale > task.maxHeight)
+            scale = static_cast<double>(task.maxHeight) / srcHeight;
+
+        width = std::max(static_cast<int>(std::lround(srcWidth * scale)) & ~1, 2);
+        height = std::max(static_cast<int>(std::lround(srcHeight * scale)) & ~1, 2);
+    }
+
+    // Nominal output frame rate: the source rate, limited by task.maxFps.
+    static AVRational PlanOutputFrameRate(const FileTask& task, const VideoJob& job) {
+        AVRational rate = av_guess_frame_rate(job.inFmtCtx, job.inFmtCtx->streams[job.videoStreamIdx], nullptr);
+        if (task.maxFps > 0 && (rate.num <= 0 || rate.den <= 0 || av_q2d(rate) > task.maxFps))
+            rate = { task.maxFps, 1 };
+        return rate;
+    }
+
+    static FrameSelection PlanFrameSelection(const FileTask& task, const VideoJob& job) {
+        AVStream* inVideoStream = job.inFmtCtx->streams[job.videoStreamIdx];
+        const AVRational sourceRate = av_guess_frame_rate(job.inFmtCtx, inVideoStream, nullptr);
+        const AVRational outputRate = PlanOutputFrameRate(task, job);
+
+        FrameSelection selection;
+        selection.origin = inVideoStream->start_time != AV_NOPTS_VALUE ? inVideoStream->start_time : 0;
+        if (sourceRate.num > 0 && sourceRate.den > 0)
+            selection.sourceInterval = av_rescale_q(1, av_inv_q(sourceRate), inVideoStream->time_base);
+        if (task.maxFps > 0 && av_cmp_q(outputRate, sourceRate) != 0)
+            selection.minInterval = av_rescale_q(1, av_inv_q(outputRate), inVideoStream->time_base);
+        selection.maxHold = av_rescale_q(DUPLICATE_MAX_HOLD_SECONDS, { 1, 1 }, inVideoStream->time_base);
+        selection.dropDuplicates = task.dropDuplicateFrames;
+        return selection;
+    }
+
+    static bool NeedsVideoScaler(const VideoJob& job) {
+        return job.decCtx->pix_fmt != job.encCtx->pix_fmt ||
+            job.decCtx->width != job.encCtx->width || job.decCtx->height != job.encCtx->height;
+    }
+
+    static bool OpenVideoScaler(VideoJob& job) {
+        job.swsKey = MakeScalerKey(job.decCtx->width, job.decCtx->height, job.decCtx->pix_fmt,
+            job.encCtx->width, job.encCtx->height, job.encCtx->pix_fmt, job.threads.scaler);
+        job.swsCtx = ScalerCache::Instance().Acquire(job.swsKey);
+        return job.swsCtx != nullptr;
+    }
+
+    // Opens the input and the output context and plans the encode; encoders
+    // are opened separately so the remux check can run first.
+    bool OpenVideoJob(const FileTask& task, VideoJob& job) const {
+        const std::string outputPath = WideToUtf8(task.outputPath);
+
+        if (!OpenVideoInput(WideToUtf8(task.path), ThreadBudget::Instance().JobShare(), job))
+            return false;
+
+        if (avformat_alloc_output_context2(&job.outFmtCtx, nullptr, nullptr, outputPath.c_str()) < 0)
+            return false;
+
+        job.copyAudio = CanCopyAudio(job);
+
+        // Audio is optional: if it cannot be decoded the video is still written
+        if (job.audioStreamIdx != -1 && !job.copyAudio) {
+            const AVCodec* audioDecoder = avcodec_find_decoder(job.inFmtCtx->streams[job.audioStreamIdx]->codecpar->codec_id);
             if (audioDecoder) {
-                audioDecCtx = avcodec_alloc_context3(audioDecoder);
-                avcodec_parameters_to_context(audioDecCtx, inFmtCtx->streams[audioStreamIdx]->codecpar);
-                avcodec_open2(audioDecCtx, audioDecoder, nullptr);
+                job.audioDecCtx = avcodec_alloc_context3(audioDecoder);
+                if (job.audioDecCtx &&
+                    (avcodec_parameters_to_context(job.audioDecCtx, job.inFmtCtx->streams[job.audioStreamIdx]->codecpar) < 0 ||
+                        avcodec_open2(job.audioDecCtx, audioDecoder, nullptr) < 0)) {
+                    avcodec_free_context(&job.audioDecCtx);
+                }
             }
         }
 
-        AVFormatContext* outFmtCtx = nullptr;
-        avformat_alloc_output_context2(&outFmtCtx, nullptr, nullptr, outputPath.c_str());
+        // A size cap that cannot be planned fails the job rather than
+        // falling back to a quality setting that may exceed it
+        if (task.rateControl == RateControl::TargetSize) {
+            job.targetVideoBitrate = PlanTargetVideoBitrate(task, job);
+            if (job.targetVideoBitrate <= 0)
+                return false;
+        }
+        job.twoPass = job.targetVideoBitrate > 0 && task.twoPass;
 
-        const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
-        AVStream* outVideoStream = avformat_new_stream(outFmtCtx, nullptr);
-        AVCodecContext* encCtx = avcodec_alloc_context3(encoder);
+        // Planned here, before OpenVideoEncoders decides on a whole-input
+        // analysis pass: an input that cannot be cut at keyframes leaves
+        // segments empty and takes the plain pipeline, two-pass included.
+        // Streams that will only be copied are not cut.
+        const int segmentCount = PlanSegmentCount(task, job);
+        if (segmentCount >= 2 && !CanRemux(task, job))
+            PlanVideoSegments(WideToUtf8(task.path), job.videoStreamIdx, segmentCount, job.segments);
 
-        encCtx->width = decCtx->width;
-        encCtx->height = decCtx->height;
-        encCtx->time_base = av_inv_q(av_guess_frame_rate(inFmtCtx, inFmtCtx->streams[videoStreamIdx], nullptr));
-        encCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-        encCtx->bit_rate = decCtx->bit_rate > 0 ? (int64_t)(decCtx->bit_rate * (task.quality / 100.0)) : 2000000;
+        return true;
+    }
 
-        if (outFmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
-            encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // Opens the encoders and output streams and writes the container header.
+    // Segment mode opens no video encoder here: the segment workers own
+    // theirs, and the header waits for the first segment's parameters.
+    bool OpenVideoEncoders(const FileTask& task, VideoJob& job) const {
+        // Segment mode runs its analysis pass per segment instead
+        int pass = 0;
+        if (job.twoPass && job.segments.empty()) {
+            const AVCodec* encoder = SelectVideoEncoder(job.outFmtCtx->oformat);
+            VideoSegment wholeInput;
+            if (encoder && PrepareTwoPass(encoder, job.stats) &&
+                EncodeVideoRange(task, job, ThreadBudget::Instance().JobShare(), 1, &job.stats, wholeInput) &&
+                job.stats.Ready()) {
+                pass = 2;
+            }
+        }
 
-        avcodec_open2(encCtx, encoder, nullptr);
-        avcodec_parameters_from_context(outVideoStream->codecpar, encCtx);
-        outVideoStream->time_base = encCtx->time_base;
+        const bool segmented = !job.segments.empty();
+        if (!segmented && !OpenVideoEncoder(task, job, job.outFmtCtx->oformat, job.encCtx, pass, &job.stats))
+            return false;
+
+        job.outVideoStream = avformat_new_stream(job.outFmtCtx, nullptr);
+        if (!job.outVideoStream)
+            return false;
+        if (!segmented) {
+            if (avcodec_parameters_from_context(job.outVideoStream->codecpar, job.encCtx) < 0)
+                return false;
+            job.outVideoStream->time_base = job.encCtx->time_base;
+        }
 
-        AVCodecContext* audioEncCtx = nullptr;
-        AVStream* outAudioStream = nullptr;
-        if (audioDecCtx) {
-            const AVCodec* audioEncoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+        if (job.copyAudio) {
+            const AVStream* inAudioStream = job.inFmtCtx->streams[job.audioStreamIdx];
+            job.outAudioStream = avformat_new_stream(job.outFmtCtx, nullptr);
+            if (!job.outAudioStream)
+                return false;
+            if (avcodec_parameters_copy(job.outAudioStream->codecpar, inAudioStream->codecpar) < 0)
+                return false;
+            job.outAudioStream->codecpar->codec_tag = 0;
+            job.outAudioStream->time_base = inAudioStream->time_base;
+        }
+        else if (job.audioDecCtx) {
+            const AVCodec* audioEncoder = SelectAudioEncoder(job.outFmtCtx->oformat);
             if (audioEncoder) {
-                outAudioStream = avformat_new_stream(outFmtCtx, nullptr);
-                audioEncCtx = avcodec_alloc_context3(audioEncoder);
-                audioEncCtx->sample_rate = audioDecCtx->sample_rate;
+                job.audioEncCtx = avcodec_alloc_context3(audioEncoder);
+                if (job.audioEncCtx) {
+                    job.audioEncCtx->sample_rate = SelectSampleRate(audioEncoder, job.audioDecCtx->sample_rate);
 
-                const enum AVSampleFormat* formats = nullptr;
+                    const enum AVSampleFormat* formats = nullptr;
 
-                if (avcodec_get_supported_config(nullptr, audioEncoder, AV_CODEC_CONFIG_SAMPLE_FORMAT,
-                    0, (const void**)&formats, nullptr) >= 0 && formats) {
-                    audioEncCtx->sample_fmt = formats[0];
+                    if (avcodec_get_supported_config(nullptr, audioEncoder, AV_CODEC_CONFIG_SAMPLE_FORMAT,
+                        0, (const void**)&formats, nullptr) >= 0 && formats) {
+                        job.audioEncCtx->sample_fmt = formats[0];
+                    }
+                    else {
+                        job.audioEncCtx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+                    }
+
+                    SelectChannelLayout(audioEncoder, job.audioDecCtx->ch_layout, &job.audioEncCtx->ch_layout);
+                    job.audioEncCtx->bit_rate = AUDIO_BITRATE;
+                    job.audioEncCtx->time_base = { 1, job.audioEncCtx->sample_rate };
+
+                    if (job.outFmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
+                        job.audioEncCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+                    if (avcodec_open2(job.audioEncCtx, audioEncoder, nullptr) < 0)
+                        avcodec_free_context(&job.audioEncCtx);
                 }
-                else {
-                    audioEncCtx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+            }
+
+            if (job.audioEncCtx) {
+                job.audioFifo = av_audio_fifo_alloc(job.audioEncCtx->sample_fmt, job.audioEncCtx->ch_layout.nb_channels,
+                    AudioFrameSize(job.audioEncCtx));
+                if (!job.audioFifo)
+                    avcodec_free_context(&job.audioEncCtx);
+            }
+
+            if (job.audioEncCtx) {
+                job.outAudioStream = avformat_new_stream(job.outFmtCtx, nullptr);
+                if (!job.outAudioStream)
+                    return false;
+                if (avcodec_parameters_from_context(job.outAudioStream->codecpar, job.audioEncCtx) < 0)
+                    return false;
+                job.outAudioStream->time_base = job.audioEncCtx->time_base;
+            }
+        }
+
+        if (segmented)
+            return true;
+
+        if (!WriteOutputHeader(task, job))
+            return false;
+
+        if (NeedsVideoScaler(job) && !OpenVideoScaler(job))
+            return false;
+
+        return true;
+    }
+
+    // Opens the output file and writes the container header, once the video
+    // stream has its codec parameters.
+    static bool WriteOutputHeader(const FileTask& task, VideoJob& job) {
+        // Apple players only open HEVC in MP4 under the hvc1 tag
+        if (job.outVideoStream->codecpar->codec_id == AV_CODEC_ID_HEVC)
+            job.outVideoStream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+
+        if (avio_open(&job.outFmtCtx->pb, WideToUtf8(task.outputPath).c_str(), AVIO_FLAG_WRITE) < 0)
+            return false;
+
+        // Animated WebP loops forever, like the GIFs it replaces
+        if (strcmp(job.outFmtCtx->oformat->name, "webp") == 0)
+            av_opt_set_int(job.outFmtCtx->priv_data, "loop", 0, 0);
+
+        return avformat_write_header(job.outFmtCtx, nullptr) >= 0;
+    }
+
+    // Video bitrate of the source, falling back to the container's average
+    // minus the audio track when the stream does not declare one.
+    static int64_t EstimateSourceVideoBitrate(const VideoJob& job) {
+        const AVCodecParameters* videoPar = job.inFmtCtx->streams[job.videoStreamIdx]->codecpar;
+        if (videoPar->bit_rate > 0)
+            return videoPar->bit_rate;
+
+        if (job.inFmtCtx->bit_rate <= 0)
+            return 0;
+
+        int64_t audioBitrate = 0;
+        if (job.audioStreamIdx != -1)
+            audioBitrate = std::max<int64_t>(job.inFmtCtx->streams[job.audioStreamIdx]->codecpar->bit_rate, 0);
+        return std::max<int64_t>(job.inFmtCtx->bit_rate - audioBitrate, 0);
+    }
+
+    // Bitrate a re-encode is expected to produce with the current settings.
+    static int64_t ExpectedVideoBitrate(const FileTask& task, const VideoJob& job, const AVCodec* encoder) {
+        if (job.targetVideoBitrate > 0)
+            return job.targetVideoBitrate;
+
+        const EncoderTuning* tuning = FindEncoderTuning(encoder);
+        if (task.rateControl == RateControl::Bitrate || !tuning)
+            return SourceScaledBitrate(task, job);
+
+        const AVRational frameRate = PlanOutputFrameRate(task, job);
+        if (frameRate.num <= 0 || frameRate.den <= 0)
+            return 0;
+
+        int width = 0;
+        int height = 0;
+        PlanVideoSize(task, job.decCtx->width, job.decCtx->height, width, height);
+        const double pixelsPerSecond = static_cast<double>(width) * height * av_q2d(frameRate);
+        return static_cast<int64_t>(InterpolateQuality(tuning->bitsPerPixel, task.quality) * pixelsPerSecond);
+    }
+
+    // True when re-encoding would not shrink the file meaningfully: the streams
+    // already use the codecs we would encode to, no downscale or fps cap applies, the
+    // audio is within our audio bitrate, and the source video bitrate is close
+    // to what we would spend. A size target also needs the input to fit it.
+    static bool CanRemux(const FileTask& task, const VideoJob& job) {
+        const AVOutputFormat* outFormat = job.outFmtCtx->oformat;
+
+        if (task.rateControl == RateControl::TargetSize) {
+            std::error_code ec;
+            const uintmax_t inputBytes = std::filesystem::file_size(task.path, ec);
+            if (ec || task.targetBytes <= 0 || inputBytes > static_cast<uintmax_t>(task.targetBytes))
+                return false;
+        }
+
+        int width = 0;
+        int height = 0;
+        PlanVideoSize(task, job.decCtx->width, job.decCtx->height, width, height);
+        if (width != job.decCtx->width || height != job.decCtx->height)
+            return false;
+
+        const AVRational sourceRate = av_guess_frame_rate(job.inFmtCtx, job.inFmtCtx->streams[job.videoStreamIdx], nullptr);
+        if (av_cmp_q(PlanOutputFrameRate(task, job), sourceRate) != 0)
+            return false;
+
+        const AVCodec* videoEncoder = SelectVideoEncoder(outFormat);
+        if (!videoEncoder || videoEncoder->id != job.inFmtCtx->streams[job.videoStreamIdx]->codecpar->codec_id)
+            return false;
+
+        if (job.audioStreamIdx != -1 && !job.copyAudio)
+            return false;
+
+        const int64_t sourceBitrate = EstimateSourceVideoBitrate(job);
+        const int64_t expectedBitrate = ExpectedVideoBitrate(task, job, videoEncoder);
+        if (sourceBitrate <= 0 || expectedBitrate <= 0)
+            return false;
+
+        return expectedBitrate >= sourceBitrate * (1.0 - REMUX_MIN_SAVING);
+    }
+
+    // Copies the video and audio packets into the output container unchanged.
+    // Returns false when any write fails; the caller removes the output.
+    bool RemuxVideo(const FileTask& task, VideoJob& job) const {
+        const std::string outputPath = WideToUtf8(task.outputPath);
+        std::vector<int> streamMap(job.inFmtCtx->nb_streams, -1);
+
+        for (const int inputIdx : { job.videoStreamIdx, job.audioStreamIdx }) {
+            if (inputIdx == -1)
+                continue;
+
+            const AVStream* inStream = job.inFmtCtx->streams[inputIdx];
+            AVStream* outStream = avformat_new_stream(job.outFmtCtx, nullptr);
+            if (!outStream)
+                return false;
+            if (avcodec_parameters_copy(outStream->codecpar, inStream->codecpar) < 0)
+                return false;
+            outStream->codecpar->codec_tag = 0;
+            outStream->time_base = inStream->time_base;
+            streamMap[inputIdx] = outStream->index;
+        }
+
+        if (avio_open(&job.outFmtCtx->pb, outputPath.c_str(), AVIO_FLAG_WRITE) < 0)
+            return false;
+
+        if (avformat_write_header(job.outFmtCtx, nullptr) < 0)
+            return false;
+
+        bool ok = true;
+        AVPacket* pkt = av_packet_alloc();
+        while (ok && pkt && av_read_frame(job.inFmtCtx, pkt) >= 0) {
+            const int outputIdx = pkt->stream_index < static_cast<int>(streamMap.size()) ? streamMap[pkt->stream_index] : -1;
+            if (outputIdx != -1) {
+                av_packet_rescale_ts(pkt, job.inFmtCtx->streams[pkt->stream_index]->time_base,
+                    job.outFmtCtx->streams[outputIdx]->time_base);
+                pkt->stream_index = outputIdx;
+                pkt->pos = -1;
+                ok = av_interleaved_write_frame(job.outFmtCtx, pkt) >= 0;
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+
+        return ok && av_write_trailer(job.outFmtCtx) >= 0;
+    }
+
+    // Receives every packet the encoder has ready and hands it to the muxer
+    // queue. Returns false when a packet is lost to an error.
+    static bool DrainEncoder(AVCodecContext* encCtx, AVStream* outStream, MediaPool& pool, PacketQueue& out) {
+        for (;;) {
+            AVPacket* encPkt = pool.AcquirePacket();
+            if (!encPkt)
+                return false;
+            const int ret = avcodec_receive_packet(encCtx, encPkt);
+            if (ret != 0) {
+                pool.Release(encPkt);
+                return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+            }
+            av_packet_rescale_ts(encPkt, encCtx->time_base, outStream->time_base);
+            encPkt->stream_index = outStream->index;
+            out.Push(encPkt);
+        }
+    }
+
+    // Damaged packets are skipped, as players do; only a frame that cannot be
+    // allocated marks the job failed.
+    static void DecodeVideoStage(VideoJob& job, PacketQueue& in, FrameQueue& out, std::atomic<bool>& failed) {
+        for (;;) {
+            AVPacket* pkt = in.Pop();
+            const bool flushing = (pkt == nullptr);
+            avcodec_send_packet(job.decCtx, pkt);
+            job.pool->Release(pkt);
+
+            for (;;) {
+                AVFrame* frame = job.pool->AcquireFrame();
+                if (!frame) {
+                    failed.store(true, std::memory_order_relaxed);
+                    break;
+                }
+                if (avcodec_receive_frame(job.decCtx, frame) != 0) {
+                    job.pool->Release(frame);
+                    break;
                 }
+                out.Push(frame);
+            }
 
-                audioEncCtx->ch_layout = audioDecCtx->ch_layout;
-                audioEncCtx->bit_rate = 128000;
-                audioEncCtx->time_base = { 1, audioDecCtx->sample_rate };
+            if (flushing)
+                break;
+        }
+        out.Push(nullptr);
+    }
 
-                if (outFmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
-                    audioEncCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // Readies a decoded frame to be sent to the encoder as is: renumbers it and
+    // drops the source's picture type so the encoder places its own keyframes.
+    static void PassThroughFrame(AVFrame* frame, int64_t pts) {
+        frame->pts = pts;
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        frame->flags &= ~AV_FRAME_FLAG_KEY;
+    }
+
+    // Converts decoded frames to the encoder's format. When no conversion is
+    // needed the decoded frame itself is forwarded: the encoder takes its own
+    // reference to the decoder's buffers, and the decoder's buffer pool keeps
+    // supplying fresh ones so decoding can run ahead up to the queue depth.
+    // A frame that cannot be converted is dropped and marks the job failed.
+    static void ScaleVideoStage(VideoJob& job, const FrameSelection& selection, FrameQueue& in, FrameQueue& out,
+        std::atomic<bool>& failed) {
+        FrameSelector selector(selection);
+
+        const auto emit = [&](AVFrame* frame, int64_t pts) {
+            if (!job.swsCtx) {
+                PassThroughFrame(frame, pts);
+                out.Push(frame);
+                return;
+            }
 
-                avcodec_open2(audioEncCtx, audioEncoder, nullptr);
-                avcodec_parameters_from_context(outAudioStream->codecpar, audioEncCtx);
-                outAudioStream->time_base = audioEncCtx->time_base;
+            AVFrame* encFrame = job.pool->AcquireFrame();
+            if (!encFrame || !job.pictures.Get(encFrame, job.encCtx->pix_fmt, job.encCtx->width, job.encCtx->height) ||
+                sws_scale_frame(job.swsCtx, encFrame, frame) < 0) {
+                failed.store(true, std::memory_order_relaxed);
+                job.pool->Release(encFrame);
+                job.pool->Release(frame);
+                return;
             }
+            encFrame->pts = pts;
+
+            job.pool->Release(frame);
+            out.Push(encFrame);
+        };
+
+        for (;;) {
+            AVFrame* frame = in.Pop();
+            if (!frame)
+                break;
+
+            int64_t pts = 0;
+            if (selector.Select(frame, pts))
+                emit(frame, pts);
+            else
+                job.pool->Release(frame);
         }
 
-        avio_open(&outFmtCtx->pb, outputPath.c_str(), AVIO_FLAG_WRITE);
-        avformat_write_header(outFmtCtx, nullptr);
+        AVFrame* tail = job.pool->AcquireFrame();
+        int64_t tailPts = 0;
+        if (tail && selector.Tail(tail, tailPts))
+            emit(tail, tailPts);
+        else
+            job.pool->Release(tail);
 
-        AVPacket* pkt = av_packet_alloc();
-        AVFrame* frame = av_frame_alloc();
-        AVFrame* encFrame = av_frame_alloc();
-        encFrame->format = encCtx->pix_fmt;
-        encFrame->width = encCtx->width;
-        encFrame->height = encCtx->height;
-        av_frame_get_buffer(encFrame, 0);
+        out.Push(nullptr);
+    }
+
+    // After an encoder error the remaining frames are only drained.
+    static void EncodeVideoStage(VideoJob& job, FrameQueue& in, PacketQueue& out, std::atomic<bool>& failed) {
+        bool ok = true;
+        for (;;) {
+            AVFrame* frame = in.Pop();
+            const bool flushing = (frame == nullptr);
+            if (ok)
+                ok = avcodec_send_frame(job.encCtx, frame) >= 0;
+            job.pool->Release(frame);
 
-        SwsContext* swsCtx = nullptr;
-        if (decCtx->pix_fmt != encCtx->pix_fmt) {
-            swsCtx = sws_getContext(decCtx->width, decCtx->height, decCtx->pix_fmt,
-                encCtx->width, encCtx->height, encCtx->pix_fmt, SWS_BILINEAR, nullptr, nullptr, nullptr);
+            if (ok)
+                ok = DrainEncoder(job.encCtx, job.outVideoStream, *job.pool, out);
+
+            if (flushing)
+                break;
         }
+        if (!ok)
+            failed.store(true, std::memory_order_relaxed);
+        out.Push(nullptr);
+    }
 
-        int64_t videoPts = 0;
-        int64_t audioPts = 0;
+    // Reusable planar/packed sample buffer for resampler output; grows only
+    // when a frame needs more samples than any before it.
+    struct SampleBuffer {
+        uint8_t** data = nullptr;
+        int capacity = 0;
 
-        while (av_read_frame(inFmtCtx, pkt) >= 0) {
-            if (pkt->stream_index == videoStreamIdx) {
-                avcodec_send_packet(decCtx, pkt);
-
-                while (avcodec_receive_frame(decCtx, frame) == 0) {
-                    av_frame_make_writable(encFrame);
-                    if (swsCtx) {
-                        sws_scale(swsCtx, frame->data, frame->linesize, 0, decCtx->height,
-                            encFrame->data, encFrame->linesize);
-                        encFrame->pts = videoPts++;
-                    }
-                    else {
-                        av_frame_copy(encFrame, frame);
-                        encFrame->pts = videoPts++;
-                    }
+        SampleBuffer() = default;
+        SampleBuffer(const SampleBuffer&) = delete;
+        SampleBuffer& operator=(const SampleBuffer&) = delete;
+
+        ~SampleBuffer() { Release(); }
+
+        bool Reserve(int samples, int channels, AVSampleFormat format) {
+            if (samples <= capacity)
+                return true;
+            Release();
+            if (av_samples_alloc_array_and_samples(&data, nullptr, channels, samples, format, 0) < 0)
+                return false;
+            capacity = samples;
+            return true;
+        }
+
+        void Release() {
+            if (data)
+                av_freep(&data[0]);
+            av_freep(&data);
+            capacity = 0;
+        }
+    };
+
+    // Moves the samples the resampler still holds back into the FIFO.
+    static void FlushResampler(VideoJob& job, SampleBuffer& buffer) {
+        if (!job.swrCtx || !swr_is_initialized(job.swrCtx))
+            return;
+
+        const int pending = swr_get_out_samples(job.swrCtx, 0);
+        if (pending > 0 && buffer.Reserve(pending, job.audioEncCtx->ch_layout.nb_channels, job.audioEncCtx->sample_fmt)) {
+            const int converted = swr_convert(job.swrCtx, buffer.data, pending, nullptr, 0);
+            if (converted > 0)
+                av_audio_fifo_write(job.audioFifo, (void**)buffer.data, converted);
+        }
+    }
+
+    // Points the resampler at the format of the incoming frame. Any samples
+    // still buffered for the previous format are flushed into the FIFO first.
+    static bool ConfigureResampler(VideoJob& job, const AVFrame* frame, SampleBuffer& buffer) {
+        FlushResampler(job, buffer);
+
+        if (swr_alloc_set_opts2(&job.swrCtx,
+            &job.audioEncCtx->ch_layout, job.audioEncCtx->sample_fmt, job.audioEncCtx->sample_rate,
+            &frame->ch_layout, static_cast<AVSampleFormat>(frame->format), frame->sample_rate, 0, nullptr) < 0) {
+            return false;
+        }
+        return swr_init(job.swrCtx) >= 0;
+    }
+
+    // Sends `samples` samples from the FIFO to the audio encoder, padding the
+    // last frame with silence if the encoder needs whole frames.
+    static bool SendAudioFrame(VideoJob& job, AVFrame* encFrame, int samples, int64_t& audioPts, PacketQueue& out) {
+        if (av_frame_make_writable(encFrame) < 0)
+            return false;
+
+        const int frameSize = AudioFrameSize(job.audioEncCtx);
+        encFrame->nb_samples = samples;
+        if (samples < frameSize && !(job.audioEncCtx->codec->capabilities &
+            (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE))) {
+            encFrame->nb_samples = frameSize;
+        }
 
-                    avcodec_send_frame(encCtx, encFrame);
+        const int read = av_audio_fifo_read(job.audioFifo, (void**)encFrame->data, samples);
+        if (read < 0)
+            return false;
+        if (read < encFrame->nb_samples) {
+            av_samples_set_silence(encFrame->data, read, encFrame->nb_samples - read,
+                job.audioEncCtx->ch_layout.nb_channels, job.audioEncCtx->sample_fmt);
+        }
 
-                    AVPacket* encPkt = av_packet_alloc();
-                    while (avcodec_receive_packet(encCtx, encPkt) == 0) {
-                        av_packet_rescale_ts(encPkt, encCtx->time_base, outVideoStream->time_base);
-                        encPkt->stream_index = outVideoStream->index;
-                        av_interleaved_write_frame(outFmtCtx, encPkt);
+        encFrame->pts = audioPts;
+        audioPts += encFrame->nb_samples;
+
+        if (avcodec_send_frame(job.audioEncCtx, encFrame) < 0)
+            return false;
+        return DrainEncoder(job.audioEncCtx, job.outAudioStream, *job.pool, out);
+    }
+
+    // Decodes audio, converts it to the encoder's sample format, rate and
+    // layout, and re-chunks it through the FIFO into the encoder's frame size.
+    // Any error marks the job failed rather than leaving the audio cut short.
+    static void AudioStage(VideoJob& job, PacketQueue& in, PacketQueue& out, std::atomic<bool>& failed) {
+        AVFrame* frame = job.pool->AcquireFrame();
+        AVFrame* encFrame = job.pool->AcquireFrame();
+        SampleBuffer converted;
+        const int frameSize = AudioFrameSize(job.audioEncCtx);
+        const int channels = job.audioEncCtx->ch_layout.nb_channels;
+        int64_t audioPts = 0;
+        int inFormat = AV_SAMPLE_FMT_NONE;
+        int inRate = 0;
+        AVChannelLayout inLayout{};
+        bool ok = frame && encFrame;
+
+        if (ok) {
+            encFrame->format = job.audioEncCtx->sample_fmt;
+            encFrame->sample_rate = job.audioEncCtx->sample_rate;
+            encFrame->nb_samples = frameSize;
+            ok = av_channel_layout_copy(&encFrame->ch_layout, &job.audioEncCtx->ch_layout) >= 0 &&
+                av_frame_get_buffer(encFrame, 0) >= 0;
+        }
+
+        for (;;) {
+            AVPacket* pkt = in.Pop();
+            const bool flushing = (pkt == nullptr);
+            if (ok)
+                avcodec_send_packet(job.audioDecCtx, pkt);
+            job.pool->Release(pkt);
+
+            while (ok && avcodec_receive_frame(job.audioDecCtx, frame) == 0) {
+                if (frame->format != inFormat || frame->sample_rate != inRate ||
+                    av_channel_layout_compare(&frame->ch_layout, &inLayout) != 0) {
+                    ok = ConfigureResampler(job, frame, converted);
+                    inFormat = frame->format;
+                    inRate = frame->sample_rate;
+                    av_channel_layout_uninit(&inLayout);
+                    av_channel_layout_copy(&inLayout, &frame->ch_layout);
+                }
+
+                // A layout or format the resampler rejects leaves it unset;
+                // the rest of the input is then only drained.
+                if (ok && job.swrCtx) {
+                    const int capacity = swr_get_out_samples(job.swrCtx, frame->nb_samples);
+                    if (capacity > 0 && converted.Reserve(capacity, channels, job.audioEncCtx->sample_fmt)) {
+                        const int samples = swr_convert(job.swrCtx, converted.data, capacity,
+                            (const uint8_t**)frame->extended_data, frame->nb_samples);
+                        if (samples > 0)
+                            av_audio_fifo_write(job.audioFifo, (void**)converted.data, samples);
                     }
-                    av_packet_free(&encPkt);
                 }
+                av_frame_unref(frame);
+
+                while (ok && av_audio_fifo_size(job.audioFifo) >= frameSize)
+                    ok = SendAudioFrame(job, encFrame, frameSize, audioPts, out);
             }
-            else if (pkt->stream_index == audioStreamIdx && audioEncCtx) {
-                avcodec_send_packet(audioDecCtx, pkt);
 
-                while (avcodec_receive_frame(audioDecCtx, frame) == 0) {
-                    frame->pts = audioPts;
-                    audioPts += frame->nb_samples;
+            if (flushing)
+                break;
+        }
 
-                    avcodec_send_frame(audioEncCtx, frame);
+        if (ok)
+            FlushResampler(job, converted);
 
-                    AVPacket* encPkt = av_packet_alloc();
-                    while (avcodec_receive_packet(audioEncCtx, encPkt) == 0) {
-                        av_packet_rescale_ts(encPkt, audioEncCtx->time_base, outAudioStream->time_base);
-                        encPkt->stream_index = outAudioStream->index;
-                        av_interleaved_write_frame(outFmtCtx, encPkt);
-                    }
-                    av_packet_free(&encPkt);
+        while (ok && av_audio_fifo_size(job.audioFifo) > 0)
+            ok = SendAudioFrame(job, encFrame, std::min(av_audio_fifo_size(job.audioFifo), frameSize), audioPts, out);
+
+        if (ok)
+            ok = avcodec_send_frame(job.audioEncCtx, nullptr) >= 0 &&
+                DrainEncoder(job.audioEncCtx, job.outAudioStream, *job.pool, out);
+        if (!ok)
+            failed.store(true, std::memory_order_relaxed);
+
+        av_channel_layout_uninit(&inLayout);
+        job.pool->Release(encFrame);
+        job.pool->Release(frame);
+        out.Push(nullptr);
+    }
+
+    // Passes the input's audio packets through, shifted so that the start of
+    // the video stream (which the encoder renumbers from 0) stays at 0.
+    static void CopyAudioStage(VideoJob& job, PacketQueue& in, PacketQueue& out) {
+        const AVStream* inAudioStream = job.inFmtCtx->streams[job.audioStreamIdx];
+        const AVStream* inVideoStream = job.inFmtCtx->streams[job.videoStreamIdx];
+        const int64_t offset = inVideoStream->start_time != AV_NOPTS_VALUE ?
+            av_rescale_q(inVideoStream->start_time, inVideoStream->time_base, inAudioStream->time_base) : 0;
+
+        for (;;) {
+            AVPacket* pkt = in.Pop();
+            if (!pkt)
+                break;
+
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts -= offset;
+            if (pkt->dts != AV_NOPTS_VALUE)
+                pkt->dts -= offset;
+            av_packet_rescale_ts(pkt, inAudioStream->time_base, job.outAudioStream->time_base);
+            pkt->stream_index = job.outAudioStream->index;
+            pkt->pos = -1;
+            out.Push(pkt);
+        }
+        out.Push(nullptr);
+    }
+
+    static void RunAudioStage(VideoJob& job, PacketQueue& in, PacketQueue& out, std::atomic<bool>& failed) {
+        if (job.copyAudio)
+            CopyAudioStage(job, in, out);
+        else
+            AudioStage(job, in, out, failed);
+    }
+
+    // Writes whichever encoded packets are ready; the interleaver in libavformat
+    // restores dts order, so neither lane has to wait for the other. After a
+    // write error, or when called with ok false because the header could not
+    // be written, the lanes are still drained, so no stage blocks, and false
+    // is returned.
+    static bool MuxStage(VideoJob& job, PacketQueue& videoOut, PacketQueue& audioOut, std::atomic<uint32_t>& muxSignal,
+        bool ok = true) {
+        bool videoDone = false;
+        bool audioDone = (job.outAudioStream == nullptr);
+
+        while (!videoDone || !audioDone) {
+            const uint32_t seen = muxSignal.load(std::memory_order_acquire);
+            bool gotPacket = false;
+            AVPacket* pkt = nullptr;
+
+            if (!videoDone && videoOut.TryPop(pkt)) {
+                gotPacket = true;
+                if (!pkt)
+                    videoDone = true;
+                else if (ok)
+                    ok = av_interleaved_write_frame(job.outFmtCtx, pkt) >= 0;
+                job.pool->Release(pkt);
+            }
+
+            if (!audioDone && audioOut.TryPop(pkt)) {
+                gotPacket = true;
+                if (!pkt)
+                    audioDone = true;
+                else if (ok)
+                    ok = av_interleaved_write_frame(job.outFmtCtx, pkt) >= 0;
+                job.pool->Release(pkt);
+            }
+
+            if (!gotPacket)
+                muxSignal.wait(seen, std::memory_order_acquire);
+        }
+        return ok;
+    }
+
+    // Runs demux on the calling thread and decode, scale, encode, audio and mux
+    // on their own threads, connected by bounded queues. A nullptr item marks
+    // the end of a stream and is forwarded by every stage. A stage that loses
+    // data keeps draining its input and sets `failed`, which fails the job.
+    static bool RunVideoPipeline(const FileTask& task, VideoJob& job) {
+        const FrameSelection selection = PlanFrameSelection(task, job);
+        PacketQueue videoPackets;
+        PacketQueue audioPackets;
+        FrameQueue decodedFrames;
+        FrameQueue scaledFrames;
+        std::atomic<uint32_t> muxSignal{ 0 };
+        PacketQueue videoOut(&muxSignal);
+        PacketQueue audioOut(&muxSignal);
+        std::atomic<bool> failed{ false };
+
+        const bool hasAudio = (job.outAudioStream != nullptr);
+
+        std::thread decodeThread([&]() { DecodeVideoStage(job, videoPackets, decodedFrames, failed); });
+        std::thread scaleThread([&]() { ScaleVideoStage(job, selection, decodedFrames, scaledFrames, failed); });
+        std::thread encodeThread([&]() { EncodeVideoStage(job, scaledFrames, videoOut, failed); });
+        std::thread audioThread;
+        if (hasAudio)
+            audioThread = std::thread([&]() { RunAudioStage(job, audioPackets, audioOut, failed); });
+        bool muxed = false;
+        std::thread muxThread([&]() { muxed = MuxStage(job, videoOut, audioOut, muxSignal); });
+
+        for (;;) {
+            AVPacket* pkt = job.pool->AcquirePacket();
+            if (!pkt)
+                break;
+            if (av_read_frame(job.inFmtCtx, pkt) < 0) {
+                job.pool->Release(pkt);
+                break;
+            }
+
+            if (pkt->stream_index == job.videoStreamIdx)
+                videoPackets.Push(pkt);
+            else if (pkt->stream_index == job.audioStreamIdx && hasAudio)
+                audioPackets.Push(pkt);
+            else
+                job.pool->Release(pkt);
+        }
+
+        videoPackets.Push(nullptr);
+        if (hasAudio)
+            audioPackets.Push(nullptr);
+
+        decodeThread.join();
+        scaleThread.join();
+        encodeThread.join();
+        if (audioThread.joinable())
+            audioThread.join();
+        muxThread.join();
+        return muxed && !failed.load();
+    }
+
+    // Number of slices to encode in parallel, or 1 to use the plain pipeline.
+    static int PlanSegmentCount(const FileTask& task, const VideoJob& job) {
+        if (task.segments == 1)
+            return 1;
+
+        const int64_t duration = job.inFmtCtx->duration;
+        if (duration == AV_NOPTS_VALUE || duration <= 0)
+            return 1;
+        const int64_t seconds = duration / AV_TIME_BASE;
+
+        // Auto mode splits only as far as the job's own thread share allows
+        int64_t count = task.segments;
+        if (count <= 0) {
+            if (seconds < SEGMENT_AUTO_MIN_SECONDS)
+                return 1;
+            count = std::min<int64_t>(ThreadBudget::Instance().JobShare() / SEGMENT_ENCODER_THREADS,
+                MAX_SEGMENTS_IN_FLIGHT);
+        }
+
+        count = std::min<int64_t>(count, seconds / SEGMENT_MIN_SECONDS);
+        return count > 1 ? static_cast<int>(count) : 1;
+    }
+
+    // Keyframe timestamps from the demuxer's index, which mp4/mov and most
+    // seekable containers fill while opening. Some formats index by dts, so
+    // the chosen cuts are confirmed with KeyframePts.
+    static bool IndexedKeyframes(AVStream* stream, std::vector<int64_t>& keyframes, int64_t& first, int64_t& last) {
+        const int entries = avformat_index_get_entries_count(stream);
+        if (entries <= 0)
+            return false;
+
+        for (int i = 0; i < entries; ++i) {
+            const AVIndexEntry* entry = avformat_index_get_entry(stream, i);
+            if (entry && (entry->flags & AVINDEX_KEYFRAME))
+                keyframes.push_back(entry->timestamp);
+        }
+
+        first = avformat_index_get_entry(stream, 0)->timestamp;
+        last = avformat_index_get_entry(stream, entries - 1)->timestamp;
+        if (stream->duration != AV_NOPTS_VALUE)
+            last = std::max(last, first + stream->duration);
+        return true;
+    }
+
+    // Fallback for inputs without an index: reads every video packet (no
+    // decoding) and records the keyframes.
+    static bool ScannedKeyframes(AVFormatContext* fmtCtx, int videoStreamIdx, std::vector<int64_t>& keyframes,
+        int64_t& first, int64_t& last) {
+        bool missingTimestamps = false;
+        bool any = false;
+
+        AVPacket* pkt = av_packet_alloc();
+        while (pkt && av_read_frame(fmtCtx, pkt) >= 0) {
+            if (pkt->stream_index == videoStreamIdx) {
+                const int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+                if (ts == AV_NOPTS_VALUE) {
+                    missingTimestamps = true;
+                }
+                else {
+                    first = any ? std::min(first, ts) : ts;
+                    last = any ? std::max(last, ts) : ts;
+                    any = true;
+                    if (pkt->flags & AV_PKT_FLAG_KEY)
+                        keyframes.push_back(ts);
                 }
             }
             av_packet_unref(pkt);
         }
+        av_packet_free(&pkt);
 
-        avcodec_send_frame(encCtx, nullptr);
-        AVPacket* encPkt = av_packet_alloc();
-        while (avcodec_receive_packet(encCtx, encPkt) == 0) {
-            av_packet_rescale_ts(encPkt, encCtx->time_base, outVideoStream->time_base);
-            encPkt->stream_index = outVideoStream->index;
-            av_interleaved_write_frame(outFmtCtx, encPkt);
+        std::sort(keyframes.begin(), keyframes.end());
+        return any && !missingTimestamps;
+    }
+
+    // pts of the keyframe the index lists at ts, read from the first video
+    // packet after seeking there; AV_NOPTS_VALUE when that is not a keyframe.
+    static int64_t KeyframePts(AVFormatContext* fmtCtx, int videoStreamIdx, int64_t ts) {
+        if (av_seek_frame(fmtCtx, videoStreamIdx, ts, AVSEEK_FLAG_BACKWARD) < 0)
+            return AV_NOPTS_VALUE;
+
+        int64_t pts = AV_NOPTS_VALUE;
+        AVPacket* pkt = av_packet_alloc();
+        while (pkt && av_read_frame(fmtCtx, pkt) >= 0) {
+            const bool video = pkt->stream_index == videoStreamIdx;
+            if (video && (pkt->flags & AV_PKT_FLAG_KEY))
+                pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            av_packet_unref(pkt);
+            if (video)
+                break;
         }
-        av_packet_free(&encPkt);
+        av_packet_free(&pkt);
+        return pts;
+    }
+
+    // Cuts the video at keyframes into at most `count` segments of similar
+    // duration. The keyframes come from the stream index when there is one,
+    // else from a packet scan; nothing is decoded either way.
+    static bool PlanVideoSegments(const std::string& inputPath, int videoStreamIdx, int count,
+        std::deque<VideoSegment>& segments) {
+        AVFormatContext* fmtCtx = nullptr;
+        if (avformat_open_input(&fmtCtx, inputPath.c_str(), nullptr, nullptr) < 0)
+            return false;
+
+        if (avformat_find_stream_info(fmtCtx, nullptr) < 0 ||
+            videoStreamIdx >= static_cast<int>(fmtCtx->nb_streams)) {
+            avformat_close_input(&fmtCtx);
+            return false;
+        }
+
+        for (unsigned i = 0; i < fmtCtx->nb_streams; ++i) {
+            if (static_cast<int>(i) != videoStreamIdx)
+                fmtCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        std::vector<int64_t> keyframes;
+        int64_t first = 0;
+        int64_t last = 0;
+        const bool indexed = IndexedKeyframes(fmtCtx->streams[videoStreamIdx], keyframes, first, last);
+        if (!indexed && !ScannedKeyframes(fmtCtx, videoStreamIdx, keyframes, first, last)) {
+            avformat_close_input(&fmtCtx);
+            return false;
+        }
+
+        const int64_t span = last - first;
+        std::vector<int64_t> cuts;
+        for (int i = 1; i < count && keyframes.size() >= 2; ++i) {
+            const int64_t target = first + span * i / count;
+            const auto it = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+            if (it == keyframes.end())
+                break;
+
+            const int64_t cut = indexed ? KeyframePts(fmtCtx, videoStreamIdx, *it) : *it;
+            if (cut == AV_NOPTS_VALUE || cut <= first || (!cuts.empty() && cut <= cuts.back()))
+                continue;
+            cuts.push_back(cut);
+        }
+        avformat_close_input(&fmtCtx);
+
+        if (cuts.empty())
+            return false;
+
+        segments.emplace_back();
+        for (const int64_t cut : cuts) {
+            segments.back().end = cut;
+            segments.emplace_back().start = cut;
+        }
+        return true;
+    }
 
-        if (audioEncCtx) {
-            avcodec_send_frame(audioEncCtx, nullptr);
-            AVPacket* audioEncPkt = av_packet_alloc();
-            while (avcodec_receive_packet(audioEncCtx, audioEncPkt) == 0) {
-                av_packet_rescale_ts(audioEncPkt, audioEncCtx->time_base, outAudioStream->time_base);
-                audioEncPkt->stream_index = outAudioStream->index;
-                av_interleaved_write_frame(outFmtCtx, audioEncPkt);
+    // Moves the encoder's ready packets into `packets`, or drops them when
+    // packets is null (analysis pass). Returns false when a packet is lost to
+    // an error.
+    static bool CollectEncodedPackets(AVCodecContext* encCtx, MediaPool& pool, std::vector<AVPacket*>* packets) {
+        for (;;) {
+            AVPacket* encPkt = pool.AcquirePacket();
+            if (!encPkt)
+                return false;
+            const int ret = avcodec_receive_packet(encCtx, encPkt);
+            if (ret != 0) {
+                pool.Release(encPkt);
+                return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+            }
+            if (!packets) {
+                pool.Release(encPkt);
+                continue;
             }
-            av_packet_free(&audioEncPkt);
+            packets->push_back(encPkt);
         }
+    }
 
-        av_write_trailer(outFmtCtx);
+    // Decodes [segment.start, segment.end) with a private demuxer, decoder and
+    // encoder opened for `pass`. Packets are kept in segment.packets in the
+    // encoder time base, with the encoder's parameters beside them, except on
+    // an analysis pass (pass 1), which only fills `stats`.
+    static bool EncodeVideoRange(const FileTask& task, const VideoJob& job, unsigned threadShare, int pass,
+        TwoPassStats* stats, VideoSegment& segment) {
+        VideoJob seg;
+        if (!OpenVideoInput(WideToUtf8(task.path), threadShare, seg) || seg.videoStreamIdx != job.videoStreamIdx)
+            return false;
 
-        if (swsCtx) sws_freeContext(swsCtx);
-        av_frame_free(&frame);
-        av_frame_free(&encFrame);
-        av_packet_free(&pkt);
-        avcodec_free_context(&decCtx);
-        if (audioDecCtx) avcodec_free_context(&audioDecCtx);
-        avcodec_free_context(&encCtx);
-        if (audioEncCtx) avcodec_free_context(&audioEncCtx);
-        avformat_close_input(&inFmtCtx);
-        avio_closep(&outFmtCtx->pb);
-        avformat_free_context(outFmtCtx);
+        seg.targetVideoBitrate = job.targetVideoBitrate;
+        if (!OpenVideoEncoder(task, seg, job.outFmtCtx->oformat, seg.encCtx, pass, stats))
+            return false;
+
+        std::vector<AVPacket*>* packets = (pass == 1) ? nullptr : &segment.packets;
+
+        if (NeedsVideoScaler(seg) && !OpenVideoScaler(seg))
+            return false;
+
+        for (unsigned i = 0; i < seg.inFmtCtx->nb_streams; ++i) {
+            if (static_cast<int>(i) != seg.videoStreamIdx)
+                seg.inFmtCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        if (segment.start != INT64_MIN &&
+            av_seek_frame(seg.inFmtCtx, seg.videoStreamIdx, segment.start, AVSEEK_FLAG_BACKWARD) < 0)
+            return false;
+
+        AVPacket* pkt = job.pool->AcquirePacket();
+        AVFrame* frame = job.pool->AcquireFrame();
+        AVFrame* encFrame = seg.swsCtx ? job.pool->AcquireFrame() : nullptr;
+        bool ok = pkt && frame && (encFrame || !seg.swsCtx);
+
+        // Every segment starts on a keyframe, which the selector always keeps
+        FrameSelector selector(PlanFrameSelection(task, seg));
+        bool reachedEnd = false;
+        bool inputDone = false;
+
+        const auto encode = [&](AVFrame* src, int64_t pts) {
+            if (!seg.swsCtx) {
+                PassThroughFrame(src, pts);
+                const bool sent = avcodec_send_frame(seg.encCtx, src) >= 0;
+                av_frame_unref(src);
+                return sent && CollectEncodedPackets(seg.encCtx, *job.pool, packets);
+            }
+
+            // The encoder may still reference the previous picture, so take a fresh pooled one
+            av_frame_unref(encFrame);
+            if (!seg.pictures.Get(encFrame, seg.encCtx->pix_fmt, seg.encCtx->width, seg.encCtx->height) ||
+                sws_scale_frame(seg.swsCtx, encFrame, src) < 0) {
+                av_frame_unref(src);
+                return false;
+            }
+            encFrame->pts = pts;
+            av_frame_unref(src);
+
+            return avcodec_send_frame(seg.encCtx, encFrame) >= 0 && CollectEncodedPackets(seg.encCtx, *job.pool, packets);
+        };
+
+        while (ok && !reachedEnd && !inputDone) {
+            const int readRet = av_read_frame(seg.inFmtCtx, pkt);
+            if (readRet >= 0 && pkt->stream_index != seg.videoStreamIdx) {
+                av_packet_unref(pkt);
+                continue;
+            }
+
+            inputDone = (readRet < 0);
+            avcodec_send_packet(seg.decCtx, inputDone ? nullptr : pkt);
+            av_packet_unref(pkt);
+
+            while (!reachedEnd && avcodec_receive_frame(seg.decCtx, frame) == 0) {
+                // Frames come out in presentation order, so the first one past
+                // the end cut means the rest of the segment has been seen
+                const int64_t ts = frame->best_effort_timestamp;
+                if (ts != AV_NOPTS_VALUE && ts < segment.start) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                if (ts != AV_NOPTS_VALUE && ts >= segment.end) {
+                    reachedEnd = true;
+                    av_frame_unref(frame);
+                    break;
+                }
+
+                int64_t pts = 0;
+                if (!selector.Select(frame, pts)) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                if (!encode(frame, pts)) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        // Only the last segment runs to the end of the input
+        int64_t tailPts = 0;
+        if (ok && segment.end == INT64_MAX && selector.Tail(frame, tailPts))
+            ok = encode(frame, tailPts);
+
+        if (ok)
+            ok = avcodec_send_frame(seg.encCtx, nullptr) >= 0 && CollectEncodedPackets(seg.encCtx, *job.pool, packets);
+
+        if (ok) {
+
+            // libvpx and libaom publish the complete first-pass log on flush
+            if (pass == 1 && stats && stats->file.empty() && seg.encCtx->stats_out)
+                stats->data = seg.encCtx->stats_out;
+
+            if (packets) {
+                segment.timeBase = seg.encCtx->time_base;
+                segment.parameters = avcodec_parameters_alloc();
+                ok = segment.parameters && avcodec_parameters_from_context(segment.parameters, seg.encCtx) >= 0;
+            }
+        }
+
+        job.pool->Release(encFrame);
+        job.pool->Release(frame);
+        job.pool->Release(pkt);
+        return ok;
     }
 
-    bool GetEncoderClsid(const WCHAR* format, CLSID* pClsid) const {
-        UINT num = 0, size = 0;
-        Gdiplus::GetImageEncodersSize(&num, &size);
-        if (size == 0) return false;
+    // Encodes one segment, with its own analysis pass when the job is two-pass
+    // so the statistics cover exactly the frames the segment encodes.
+    static bool EncodeVideoSegment(const FileTask& task, const VideoJob& job, unsigned threadShare, VideoSegment& segment) {
+        if (job.twoPass) {
+            const AVCodec* encoder = SelectVideoEncoder(job.outFmtCtx->oformat);
+            TwoPassStats stats;
+            if (encoder && PrepareTwoPass(encoder, stats)) {
+                VideoSegment analysis;
+                analysis.start = segment.start;
+                analysis.end = segment.end;
+                if (EncodeVideoRange(task, job, threadShare, 1, &stats, analysis) && stats.Ready())
+                    return EncodeVideoRange(task, job, threadShare, 2, &stats, segment);
+            }
+        }
+        return EncodeVideoRange(task, job, threadShare, 0, nullptr, segment);
+    }
+
+    // Re-times one segment's packets to continue from lastDts, the last dts of
+    // the segments before it. An encoder's leading packets start dts before
+    // the segment's first pts (B-frame delay), which can overlap the previous
+    // segment, so every dts is raised to at least one past the one before.
+    // When that would put a dts past its pts, the whole segment moves later by
+    // the smallest amount that keeps dts <= pts; within a segment dts is
+    // strictly increasing, so that amount is the largest such overshoot.
+    static void RetimeSegment(std::vector<AVPacket*>& packets, int64_t& lastDts) {
+        int64_t shift = 0;
+        if (lastDts != AV_NOPTS_VALUE) {
+            int64_t dts = lastDts;
+            for (const AVPacket* pkt : packets) {
+                if (pkt->dts == AV_NOPTS_VALUE)
+                    continue;
+                dts = std::max(pkt->dts, dts + 1);
+                if (pkt->pts != AV_NOPTS_VALUE)
+                    shift = std::max(shift, dts - pkt->pts);
+            }
+        }
+
+        for (AVPacket* pkt : packets) {
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts += shift;
+            if (pkt->dts == AV_NOPTS_VALUE)
+                continue;
+            pkt->dts += shift;
+            if (lastDts != AV_NOPTS_VALUE && pkt->dts <= lastDts)
+                pkt->dts = lastDts + 1;
+            lastDts = pkt->dts;
+        }
+    }
 
-        auto* pImageCodecInfo = static_cast<Gdiplus::ImageCodecInfo*>(malloc(size));
-        if (!pImageCodecInfo) return false;
+    // Hands finished segments to the muxer strictly in order, each re-timed
+    // to continue the dts of the ones before, and counts them in fedSegments.
+    // The first one also supplies the video stream parameters for the header,
+    // whose outcome is published in headerState. Returns false, after ending
+    // the stream early, when a segment failed to encode or the header failed.
+    static bool FeedVideoSegments(const FileTask& task, VideoJob& job, PacketQueue& out,
+        std::atomic<size_t>& fedSegments, std::atomic<int>& headerState) {
+        int64_t lastDts = AV_NOPTS_VALUE;
+        bool ok = true;
+
+        for (auto& segment : job.segments) {
+            int state = segment.state.load(std::memory_order_acquire);
+            while (state == SEGMENT_PENDING) {
+                segment.state.wait(state, std::memory_order_acquire);
+                state = segment.state.load(std::memory_order_acquire);
+            }
+            if (state == SEGMENT_FAILED) {
+                ok = false;
+                break;
+            }
 
-        Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
+            if (headerState.load(std::memory_order_relaxed) == SEGMENT_PENDING) {
+                job.outVideoStream->time_base = segment.timeBase;
+                ok = avcodec_parameters_copy(job.outVideoStream->codecpar, segment.parameters) >= 0 &&
+                    WriteOutputHeader(task, job);
+                headerState.store(ok ? SEGMENT_DONE : SEGMENT_FAILED, std::memory_order_release);
+                headerState.notify_all();
+                if (!ok)
+                    break;
+            }
 
-        for (UINT i = 0; i < num; ++i) {
-            if (wcscmp(pImageCodecInfo[i].MimeType, format) == 0) {
-                *pClsid = pImageCodecInfo[i].Clsid;
-                free(pImageCodecInfo);
-                return true;
+            // The header may have picked its own stream time base
+            for (AVPacket* pkt : segment.packets) {
+                av_packet_rescale_ts(pkt, segment.timeBase, job.outVideoStream->time_base);
+                pkt->stream_index = job.outVideoStream->index;
             }
+            RetimeSegment(segment.packets, lastDts);
+            for (AVPacket*& pkt : segment.packets) {
+                out.Push(pkt);
+                pkt = nullptr;
+            }
+            segment.packets.clear();
+
+            fedSegments.fetch_add(1, std::memory_order_release);
+            fedSegments.notify_all();
         }
-        free(pImageCodecInfo);
-        return false;
+
+        if (headerState.load(std::memory_order_relaxed) == SEGMENT_PENDING) {
+            headerState.store(SEGMENT_FAILED, std::memory_order_release);
+            headerState.notify_all();
+        }
+        out.Push(nullptr);
+        return ok;
     }
 
-    void OnCompressComplete() {
-        int done = 0;
-        {
-            std::lock_guard<std::mutex> lock(taskMutex);
-            for (const auto& task : tasks)
-                if (task.done) ++done;
+    // Segment mode: worker threads encode the planned keyframe-aligned slices
+    // of the input while the job thread demuxes audio for the usual audio
+    // lane. A worker starts a segment only while fewer than workerCount are
+    // ahead of the feeder, so finished but unfed segments stay bounded.
+    // Returns false when a segment could not be encoded or written.
+    static bool RunSegmentedVideo(const FileTask& task, VideoJob& job) {
+        std::deque<VideoSegment>& segments = job.segments;
+        std::atomic<size_t> nextSegment{ 0 };
+        std::atomic<size_t> fedSegments{ 0 };
+        std::atomic<int> headerState{ SEGMENT_PENDING };
+        std::atomic<bool> failed{ false };
+        const size_t workerCount = std::min({ segments.size(), MAX_SEGMENTS_IN_FLIGHT,
+            static_cast<size_t>(std::max(ThreadBudget::Instance().JobShare() / SEGMENT_ENCODER_THREADS, 1u)) });
+        std::vector<std::thread> workers;
+        workers.reserve(workerCount);
+        for (size_t w = 0; w < workerCount; ++w) {
+            workers.emplace_back([&]() {
+                for (;;) {
+                    const size_t i = nextSegment.fetch_add(1);
+                    if (i >= segments.size())
+                        return;
+                    size_t fed = fedSegments.load(std::memory_order_acquire);
+                    while (i >= fed + workerCount) {
+                        fedSegments.wait(fed, std::memory_order_acquire);
+                        fed = fedSegments.load(std::memory_order_acquire);
+                    }
+                    // The feeder stops at a failed segment, so later ones are not needed
+                    if (failed.load(std::memory_order_acquire))
+                        return;
+                    // Re-read the share per segment so freed threads are picked up
+                    const unsigned share = std::max<unsigned>(
+                        ThreadBudget::Instance().JobShare() / static_cast<unsigned>(workerCount), 1);
+                    VideoSegment& segment = segments[i];
+                    segment.state.store(EncodeVideoSegment(task, job, share, segment) ? SEGMENT_DONE : SEGMENT_FAILED,
+                        std::memory_order_release);
+                    segment.state.notify_all();
+                }
+                });
+        }
+
+        PacketQueue audioPackets;
+        std::atomic<uint32_t> muxSignal{ 0 };
+        PacketQueue videoOut(&muxSignal);
+        PacketQueue audioOut(&muxSignal);
+
+        const bool hasAudio = (job.outAudioStream != nullptr);
+
+        // Kept apart from `failed`, which only the feeder may set: workers
+        // that stop early would leave it waiting on segments never started
+        std::atomic<bool> audioFailed{ false };
+        bool fed = true;
+        std::thread feedThread([&]() {
+            fed = FeedVideoSegments(task, job, videoOut, fedSegments, headerState);
+            if (!fed)
+                failed.store(true, std::memory_order_release);
+            // Releases the workers still waiting for room
+            fedSegments.store(segments.size(), std::memory_order_release);
+            fedSegments.notify_all();
+            });
+        std::thread audioThread;
+        if (hasAudio)
+            audioThread = std::thread([&]() { RunAudioStage(job, audioPackets, audioOut, audioFailed); });
+        bool muxed = false;
+        std::thread muxThread([&]() {
+            int header = headerState.load(std::memory_order_acquire);
+            while (header == SEGMENT_PENDING) {
+                headerState.wait(header, std::memory_order_acquire);
+                header = headerState.load(std::memory_order_acquire);
+            }
+            muxed = MuxStage(job, videoOut, audioOut, muxSignal, header == SEGMENT_DONE);
+            });
+
+        if (hasAudio) {
+            job.inFmtCtx->streams[job.videoStreamIdx]->discard = AVDISCARD_ALL;
+
+            for (;;) {
+                AVPacket* pkt = job.pool->AcquirePacket();
+                if (!pkt)
+                    break;
+                if (av_read_frame(job.inFmtCtx, pkt) < 0) {
+                    job.pool->Release(pkt);
+                    break;
+                }
+
+                if (pkt->stream_index == job.audioStreamIdx)
+                    audioPackets.Push(pkt);
+                else
+                    job.pool->Release(pkt);
+            }
+            audioPackets.Push(nullptr);
+        }
+
+        feedThread.join();
+        if (audioThread.joinable())
+            audioThread.join();
+        muxThread.join();
+        for (auto& worker : workers)
+            worker.join();
+        return fed && muxed && !audioFailed.load();
+    }
+
+    // Closes and deletes a partly written output, so a failed job leaves no
+    // truncated file behind.
+    static void DiscardVideoOutput(const FileTask& task, VideoJob& job) {
+        if (!job.outFmtCtx || !job.outFmtCtx->pb)
+            return;
+        avio_closep(&job.outFmtCtx->pb);
+        std::error_code ec;
+        std::filesystem::remove(task.outputPath, ec);
+    }
+
+    // True when a written output is larger than the task's size cap.
+    static bool ExceedsTargetSize(const FileTask& task, const VideoJob& job) {
+        return task.rateControl == RateControl::TargetSize && avio_size(job.outFmtCtx->pb) > task.targetBytes;
+    }
+
+    bool CompressVideo(const FileTask& task) const {
+        VideoJob job;
+        if (!OpenVideoJob(task, job))
+            return false;
+
+        if (!CanRemux(task, job))
+            return EncodeVideo(task, job);
+
+        if (RemuxVideo(task, job) && !ExceedsTargetSize(task, job))
+            return true;
+
+        // The failed copy consumed the demuxer and added its own output
+        // streams, so the re-encode starts from a freshly opened job
+        DiscardVideoOutput(task, job);
+        VideoJob retry;
+        return OpenVideoJob(task, retry) && EncodeVideo(task, retry);
+    }
+
+    bool EncodeVideo(const FileTask& task, VideoJob& job) const {
+        if (!OpenVideoEncoders(task, job)) {
+            DiscardVideoOutput(task, job);
+            return false;
         }
 
+        const bool ok = job.segments.empty() ? RunVideoPipeline(task, job) : RunSegmentedVideo(task, job);
+
+        if (!ok || av_write_trailer(job.outFmtCtx) < 0) {
+            DiscardVideoOutput(task, job);
+            return false;
+        }
+
+        // Encoders without bitrate control (libwebp) can still miss the cap
+        if (ExceedsTargetSize(task, job)) {
+            DiscardVideoOutput(task, job);
+            return false;
+        }
+        return true;
+    }
+
+    void OnCompressComplete() {
+        const int done = completedTasks.load();
+
         SendMessage(progressBar, PBM_SETPOS, done, 0);
 
         if (done == static_cast<int>(tasks.size())) {
@@ -863,15 +3273,28 @@ class Compressor {
     }
 
 public:
-    Compressor() : hwnd(nullptr), listBox(nullptr), qualitySlider(nullptr),
-        qualityLabel(nullptr), compressBtn(nullptr), progressBar(nullptr),
-        removeBtn(nullptr), gdiplusToken(0) {
-        Gdiplus::GdiplusStartupInput gdiplusStartupInput;
-        Gdiplus::GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, nullptr);
+    // workerCount == 0 sizes the job pool from the hardware thread count.
+    // Every task starts from `settings`; the window's slider sets the quality.
+    explicit Compressor(unsigned workerCount = 0, const FileTask& settings = FileTask()) : hwnd(nullptr),
+        listBox(nullptr), qualitySlider(nullptr), qualityLabel(nullptr), compressBtn(nullptr),
+        progressBar(nullptr), removeBtn(nullptr), pool(std::make_unique<WorkerPool>(workerCount)),
+        settings(settings) {
     }
 
-    ~Compressor() {
-        Gdiplus::GdiplusShutdown(gdiplusToken);
+    // Compresses files without opening the window, for scripts and batch
+    // checks of the encoders. Returns how many of them failed.
+    int RunHeadless(const std::vector<std::wstring>& files) {
+        tasks.clear();
+        for (const auto& path : files)
+            tasks.push_back(MakeTask(path, settings.quality));
+
+        std::atomic<int> failed = 0;
+        pool->ParallelFor(tasks.size(), [&](size_t i) {
+            if (!CompressFile(tasks[i]))
+                failed.fetch_add(1);
+            tasks[i].done = true;
+            });
+        return failed.load();
     }
 
     int Run(HINSTANCE hInst) {
@@ -901,12 +3324,173 @@ public:
     }
 };
 
+// Switches and input files from the command line. Input files make the run
+// headless: they are compressed without the window and the exit code is the
+// number that failed. The encoding switches apply to windowed runs as well:
+//
+//   --workers=N                  Parallel jobs, 0 = one per hardware thread
+//   --quality=1-100              Headless quality (the window uses its slider)
+//   --rate=quality|bitrate|size  Video rate control
+//   --target-size=N[K|M|G]       Output size cap in bytes; implies --rate=size
+//   --single-pass                No analysis pass when hitting a target size
+//   --preset=fast|medium|slow    Encoder speed preset
+//   --segments=N                 Video slices encoded in parallel, 0 = auto, 1 = off
+//   --max-width=N --max-height=N --max-fps=N
+//   --drop-duplicates            Skip frames that barely differ from the last one
+//   --gif=gif|mp4|webm|webp      What GIF inputs become
+//   --gif-local-palettes         One palette per GIF frame
+//   --format=jpeg|png|webp|avif  Image output format
+//   --candidates=FORMAT,...      Encode each image format and keep the smallest
+//   --png-quantize --no-dither   Lossy palette PNG, with or without dithering
+//   --webp-lossless
+//   --baseline-jpeg              One baseline scan instead of progressive ones
+//   --subsampling=auto|444|422|420
+struct CommandLine {
+    unsigned workers = 0;
+    FileTask settings;
+    std::vector<std::wstring> files;
+};
+
+static bool ParseImageFormat(const std::wstring& name, ImageFormat& format) {
+    if (name == L"jpeg" || name == L"jpg")
+        format = ImageFormat::Jpeg;
+    else if (name == L"png")
+        format = ImageFormat::Png;
+    else if (name == L"webp")
+        format = ImageFormat::WebP;
+    else if (name == L"avif")
+        format = ImageFormat::Avif;
+    else
+        return false;
+    return true;
+}
+
+// Byte count with an optional K, M or G (binary) suffix; 0 when malformed.
+static int64_t ParseByteCount(const std::wstring& text) {
+    wchar_t* end = nullptr;
+    const long long value = wcstoll(text.c_str(), &end, 10);
+    if (value <= 0 || end == text.c_str())
+        return 0;
+    switch (towupper(*end)) {
+    case L'\0': return value;
+    case L'K':  return value << 10;
+    case L'M':  return value << 20;
+    case L'G':  return value << 30;
+    default:    return 0;
+    }
+}
+
+// Applies one --name or --name=value switch; false when it is not known.
+static bool ParseSwitch(const std::wstring& arg, CommandLine& commandLine) {
+    FileTask& task = commandLine.settings;
+    const size_t equals = arg.find(L'=');
+    const std::wstring name = arg.substr(0, equals);
+    const std::wstring value = equals == std::wstring::npos ? L"" : arg.substr(equals + 1);
+    const int number = _wtoi(value.c_str());
+
+    if (name == L"--workers")
+        commandLine.workers = number > 0 ? static_cast<unsigned>(number) : 0;
+    else if (name == L"--quality")
+        task.quality = std::clamp(number, 1, 100);
+    else if (name == L"--rate" && value == L"quality")
+        task.rateControl = RateControl::ConstantQuality;
+    else if (name == L"--rate" && value == L"bitrate")
+        task.rateControl = RateControl::Bitrate;
+    else if (name == L"--rate" && value == L"size")
+        task.rateControl = RateControl::TargetSize;
+    else if (name == L"--target-size" && ParseByteCount(value) > 0) {
+        task.targetBytes = ParseByteCount(value);
+        task.rateControl = RateControl::TargetSize;
+    }
+    else if (name == L"--single-pass")
+        task.twoPass = false;
+    else if (name == L"--preset" && value == L"fast")
+        task.preset = EncoderPreset::Fast;
+    else if (name == L"--preset" && value == L"medium")
+        task.preset = EncoderPreset::Medium;
+    else if (name == L"--preset" && value == L"slow")
+        task.preset = EncoderPreset::Slow;
+    else if (name == L"--segments")
+        task.segments = std::max(number, 0);
+    else if (name == L"--max-width")
+        task.maxWidth = std::max(number, 0);
+    else if (name == L"--max-height")
+        task.maxHeight = std::max(number, 0);
+    else if (name == L"--max-fps")
+        task.maxFps = std::max(number, 0);
+    else if (name == L"--drop-duplicates")
+        task.dropDuplicateFrames = true;
+    else if (name == L"--gif" && value == L"gif")
+        task.gifOutput = GifOutput::Gif;
+    else if (name == L"--gif" && value == L"mp4")
+        task.gifOutput = GifOutput::Mp4;
+    else if (name == L"--gif" && value == L"webm")
+        task.gifOutput = GifOutput::WebM;
+    else if (name == L"--gif" && value == L"webp")
+        task.gifOutput = GifOutput::WebP;
+    else if (name == L"--gif-local-palettes")
+        task.gifLocalPalettes = true;
+    else if (name == L"--format")
+        return ParseImageFormat(value, task.imageFormat);
+    else if (name == L"--candidates") {
+        std::vector<ImageFormat> candidates;
+        for (size_t start = 0; start <= value.size();) {
+            const size_t comma = std::min(value.find(L',', start), value.size());
+            ImageFormat format;
+            if (!ParseImageFormat(value.substr(start, comma - start), format))
+                return false;
+            candidates.push_back(format);
+            start = comma + 1;
+        }
+        task.imageCandidates = candidates;
+    }
+    else if (name == L"--png-quantize")
+        task.pngQuantize = true;
+    else if (name == L"--no-dither")
+        task.pngDither = false;
+    else if (name == L"--webp-lossless")
+        task.webpLossless = true;
+    else if (name == L"--baseline-jpeg")
+        task.jpegProgressive = false;
+    else if (name == L"--subsampling" && value == L"auto")
+        task.jpegSubsampling = ChromaSubsampling::Auto;
+    else if (name == L"--subsampling" && value == L"444")
+        task.jpegSubsampling = ChromaSubsampling::Yuv444;
+    else if (name == L"--subsampling" && value == L"422")
+        task.jpegSubsampling = ChromaSubsampling::Yuv422;
+    else if (name == L"--subsampling" && value == L"420")
+        task.jpegSubsampling = ChromaSubsampling::Yuv420;
+    else
+        return false;
+    return true;
+}
+
+// Unknown or malformed switches are ignored, leaving that setting at its default.
+static CommandLine ParseCommandLine() {
+    CommandLine result;
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (!argv)
+        return result;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::wstring arg = argv[i];
+        if (arg.rfind(L"--", 0) == 0)
+            ParseSwitch(arg, result);
+        else
+            result.files.push_back(arg);
+    }
+    LocalFree(argv);
+    return result;
+}
+
 int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE, LPWSTR, int) {
     CoInitialize(nullptr);
     InitCommonControls();
 
-    Compressor app;
-    const int ret = app.Run(hInst);
+    const CommandLine commandLine = ParseCommandLine();
+    Compressor app(commandLine.workers, commandLine.settings);
+    const int ret = commandLine.files.empty() ? app.Run(hInst) : app.RunHeadless(commandLine.files);
 
     CoUninitialize();
     return ret;
@@ -0,0 +1,679 @@
+#include "ImageEngine.h"
+#include "JpegWriter.h"
+#include "PngOptimizer.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/display.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+// AV1 CRF for AVIF at quality 1, 50, 75 and 100 (interpolated in between),
+// and the quality from which chroma is kept at full resolution.
+constexpr int AVIF_ANCHOR_QUALITY[4] = { 1, 50, 75, 100 };
+constexpr double AVIF_CRF[4] = { 58, 38, 30, 14 };
+constexpr int AVIF_FULL_CHROMA_QUALITY = 90;
+
+// libaom speed for stills: avifenc's default trade-off. Lower is smaller and
+// much slower.
+constexpr int AVIF_CPU_USED = 6;
+
+// libwebp's lossless mode takes quality as compression effort.
+constexpr int WEBP_LOSSLESS_EFFORT = 100;
+
+// Decoder and demuxer of one input picture, freed together.
+struct ImageInput {
+    AVFormatContext* fmtCtx = nullptr;
+    AVCodecContext* decCtx = nullptr;
+    AVPacket* packet = nullptr;
+
+    ~ImageInput() {
+        av_packet_free(&packet);
+        avcodec_free_context(&decCtx);
+        avformat_close_input(&fmtCtx);
+    }
+};
+
+bool ImageEngine::Compress(const std::string& inputPath, const std::string& outputPath, const ImageOptions& options) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+        return false;
+
+    ImageFormat sourceFormat = ImageFormat::Unknown;
+    bool animated = false;
+    if (!Decode(inputPath, options.threads, frame, &sourceFormat, &animated)) {
+        av_frame_free(&frame);
+        return false;
+    }
+    if (animated) {
+        av_frame_free(&frame);
+        std::vector<uint8_t> source;
+        return ReadFile(inputPath, source) && WriteFile(outputPath, source);
+    }
+
+    struct Attempt {
+        explicit Attempt(ImageFormat format) : format(format) {}
+
+        ImageFormat format;
+        std::vector<uint8_t> data;
+        bool ok = false;
+    };
+    std::vector<Attempt> attempts;
+    if (options.candidates.empty()) {
+        attempts.emplace_back(OutputFormat(options.format, sourceFormat, frame));
+    }
+    else {
+        for (ImageFormat format : options.candidates)
+            attempts.emplace_back(format);
+    }
+
+    // Parallel attempts split the thread share between them.
+    const bool parallel = options.pool && attempts.size() > 1;
+    auto runAttempt = [&](size_t i) {
+        ImageOptions output = options;
+        output.format = attempts[i].format;
+        if (parallel)
+            output.threads = std::max(1, options.threads / static_cast<int>(attempts.size()));
+        attempts[i].ok = Encode(frame, output, attempts[i].data);
+    };
+    if (parallel) {
+        options.pool->ParallelFor(attempts.size(), runAttempt);
+    }
+    else {
+        for (size_t i = 0; i < attempts.size(); ++i)
+            runAttempt(i);
+    }
+    av_frame_free(&frame);
+
+    Attempt* best = nullptr;
+    bool triedSource = false;
+    for (Attempt& attempt : attempts) {
+        triedSource |= attempt.format == sourceFormat;
+        if (attempt.ok && (!best || attempt.data.size() < best->data.size()))
+            best = &attempt;
+    }
+
+    if (triedSource && (!best || static_cast<int64_t>(best->data.size()) >= FileSize(inputPath))) {
+        std::vector<uint8_t> source;
+        if (ReadFile(inputPath, source))
+            return WriteFile(outputPath, source);
+    }
+    if (!best)
+        return false;
+
+    if (best->format == sourceFormat)
+        return WriteFile(outputPath, best->data);
+    return WriteFile(ReplaceExtension(outputPath, Extension(best->format)), best->data);
+}
+
+bool ImageEngine::Decode(const std::string& path, int threads, AVFrame* frame, ImageFormat* sourceFormat,
+    bool* animated) {
+    ImageInput input;
+    if (avformat_open_input(&input.fmtCtx, path.c_str(), nullptr, nullptr) < 0)
+        return false;
+
+    // The image demuxers fill in the codec from the file header, so there is
+    // no need for avformat_find_stream_info to decode the picture twice.
+    int streamIdx = -1;
+    for (unsigned i = 0; i < input.fmtCtx->nb_streams; ++i) {
+        if (input.fmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            streamIdx = i;
+            break;
+        }
+    }
+    if (streamIdx == -1)
+        return false;
+
+    const AVCodecParameters* codecpar = input.fmtCtx->streams[streamIdx]->codecpar;
+    const AVCodec* decoder = avcodec_find_decoder(codecpar->codec_id);
+    if (!decoder)
+        return false;
+    if (sourceFormat)
+        *sourceFormat = FormatOf(codecpar->codec_id);
+
+    input.decCtx = avcodec_alloc_context3(decoder);
+    input.packet = av_packet_alloc();
+    if (!input.decCtx || !input.packet)
+        return false;
+    if (avcodec_parameters_to_context(input.decCtx, codecpar) < 0)
+        return false;
+
+    input.decCtx->thread_count = std::max(threads, 1);
+    input.decCtx->thread_type = FF_THREAD_SLICE;
+    if (avcodec_open2(input.decCtx, decoder, nullptr) < 0)
+        return false;
+
+    bool decoded = false;
+    while (!decoded && av_read_frame(input.fmtCtx, input.packet) >= 0) {
+        if (input.packet->stream_index != streamIdx) {
+            av_packet_unref(input.packet);
+            continue;
+        }
+        const int ret = avcodec_send_packet(input.decCtx, input.packet);
+        av_packet_unref(input.packet);
+        if (ret < 0 && ret != AVERROR(EAGAIN))
+            return false;
+        decoded = avcodec_receive_frame(input.decCtx, frame) >= 0;
+    }
+
+    if (!decoded) {
+        avcodec_send_packet(input.decCtx, nullptr);
+        if (avcodec_receive_frame(input.decCtx, frame) < 0)
+            return false;
+    }
+    if (animated)
+        *animated = IsAnimated(path, input.fmtCtx, streamIdx);
+    return ApplyOrientation(frame, threads);
+}
+
+// Called after the first picture was read: another packet in its stream, an
+// APNG stream, or a WebP whose VP8X header sets the animation flag (the WebP
+// demuxer can hand over the whole file as one packet) means more pictures.
+bool ImageEngine::IsAnimated(const std::string& path, AVFormatContext* fmtCtx, int streamIdx) {
+    const AVCodecID codecId = fmtCtx->streams[streamIdx]->codecpar->codec_id;
+    if (codecId == AV_CODEC_ID_APNG)
+        return true;
+
+    bool more = false;
+    AVPacket* packet = av_packet_alloc();
+    while (packet && !more && av_read_frame(fmtCtx, packet) >= 0) {
+        more = packet->stream_index == streamIdx;
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    if (more || codecId != AV_CODEC_ID_WEBP)
+        return more;
+
+    AVIOContext* io = nullptr;
+    if (avio_open(&io, path.c_str(), AVIO_FLAG_READ) < 0)
+        return false;
+    uint8_t header[21];
+    const bool read = avio_read(io, header, sizeof(header)) == sizeof(header);
+    avio_closep(&io);
+    return read && std::memcmp(header, "RIFF", 4) == 0 && std::memcmp(header + 8, "WEBPVP8X", 8) == 0 &&
+        (header[20] & 0x02);
+}
+
+bool ImageEngine::Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out) {
+    if (options.format == ImageFormat::Jpeg)
+        return JpegWriter::Encode(frame, options, out);
+    if (options.format == ImageFormat::Png)
+        return PngOptimizer::Encode(frame, options, out);
+    if (options.format == ImageFormat::Avif)
+        return EncodeAvif(frame, options, out);
+
+    const AVCodec* encoder = avcodec_find_encoder_by_name(EncoderName(options.format));
+    if (!encoder)
+        return false;
+
+    const AVPixelFormat format = SelectPixelFormat(encoder, static_cast<AVPixelFormat>(frame->format));
+    if (format == AV_PIX_FMT_NONE)
+        return false;
+
+    AVFrame* converted = nullptr;
+    const AVFrame* picture = frame;
+    if (format != frame->format) {
+        converted = av_frame_alloc();
+        if (!converted || !Convert(frame, format, AVCOL_RANGE_UNSPECIFIED, options.threads, converted)) {
+            av_frame_free(&converted);
+            return false;
+        }
+        picture = converted;
+    }
+
+    const bool ok = RunEncoder(encoder, picture, [&](AVCodecContext* encCtx) {
+        encCtx->thread_count = std::max(options.threads, 1);
+        ApplyQuality(encCtx, options);
+        }, out);
+
+    av_frame_free(&converted);
+    return ok;
+}
+
+bool ImageEngine::RunEncoder(const AVCodec* encoder, const AVFrame* picture,
+    const std::function<void(AVCodecContext*)>& configure, std::vector<uint8_t>& out,
+    AVCodecParameters* parameters) {
+    AVCodecContext* encCtx = avcodec_alloc_context3(encoder);
+    AVPacket* packet = av_packet_alloc();
+    bool ok = encCtx && packet;
+
+    if (ok) {
+        encCtx->width = picture->width;
+        encCtx->height = picture->height;
+        encCtx->pix_fmt = static_cast<AVPixelFormat>(picture->format);
+        encCtx->color_range = picture->color_range;
+        encCtx->color_primaries = picture->color_primaries;
+        encCtx->color_trc = picture->color_trc;
+        encCtx->colorspace = picture->colorspace;
+        encCtx->sample_aspect_ratio = picture->sample_aspect_ratio;
+        encCtx->time_base = { 1, 25 };
+        configure(encCtx);
+        ok = avcodec_open2(encCtx, encoder, nullptr) >= 0;
+    }
+    if (ok && parameters)
+        ok = avcodec_parameters_from_context(parameters, encCtx) >= 0;
+
+    // Encoders must not see the caller's timestamps, so send a shallow copy.
+    AVFrame* input = ok ? av_frame_clone(picture) : nullptr;
+    if (input) {
+        input->pts = 0;
+        input->pict_type = AV_PICTURE_TYPE_NONE;
+        ok = avcodec_send_frame(encCtx, input) >= 0 && avcodec_send_frame(encCtx, nullptr) >= 0;
+    }
+    else {
+        ok = false;
+    }
+
+    out.clear();
+    while (ok) {
+        const int ret = avcodec_receive_packet(encCtx, packet);
+        if (ret == AVERROR_EOF)
+            break;
+        if (ret < 0) {
+            ok = false;
+            break;
+        }
+        out.insert(out.end(), packet->data, packet->data + packet->size);
+        av_packet_unref(packet);
+    }
+
+    av_frame_free(&input);
+    av_packet_free(&packet);
+    avcodec_free_context(&encCtx);
+    return ok && !out.empty();
+}
+
+bool ImageEngine::ReadFile(const std::string& path, std::vector<uint8_t>& data) {
+    AVIOContext* io = nullptr;
+    if (avio_open(&io, path.c_str(), AVIO_FLAG_READ) < 0)
+        return false;
+
+    const int64_t size = avio_size(io);
+    bool ok = size >= 0 && size <= INT_MAX;
+    if (ok) {
+        data.resize(static_cast<size_t>(size));
+        ok = avio_read(io, data.data(), static_cast<int>(size)) == size;
+    }
+    avio_closep(&io);
+    return ok;
+}
+
+bool ImageEngine::WriteFile(const std::string& path, const std::vector<uint8_t>& data) {
+    AVIOContext* io = nullptr;
+    if (avio_open(&io, path.c_str(), AVIO_FLAG_WRITE) < 0)
+        return false;
+
+    avio_write(io, data.data(), static_cast<int>(data.size()));
+    avio_flush(io);
+    const bool ok = io->error == 0;
+    avio_closep(&io);
+    return ok;
+}
+
+ImageFormat ImageEngine::OutputFormat(ImageFormat requested, ImageFormat source, const AVFrame* frame) {
+    if (requested != ImageFormat::Unknown)
+        return requested;
+    if (source != ImageFormat::Unknown)
+        return source;
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA) ? ImageFormat::Png : ImageFormat::Jpeg;
+}
+
+ImageFormat ImageEngine::FormatOf(AVCodecID codecId) {
+    switch (codecId) {
+    case AV_CODEC_ID_MJPEG: return ImageFormat::Jpeg;
+    case AV_CODEC_ID_PNG:   return ImageFormat::Png;
+    case AV_CODEC_ID_WEBP:  return ImageFormat::WebP;
+    case AV_CODEC_ID_AV1:   return ImageFormat::Avif;
+    default:                return ImageFormat::Unknown;
+    }
+}
+
+// -1 when the file cannot be opened or has no known size.
+int64_t ImageEngine::FileSize(const std::string& path) {
+    AVIOContext* io = nullptr;
+    if (avio_open(&io, path.c_str(), AVIO_FLAG_READ) < 0)
+        return -1;
+
+    const int64_t size = avio_size(io);
+    avio_closep(&io);
+    return size;
+}
+
+std::string ImageEngine::ReplaceExtension(const std::string& path, const char* extension) {
+    const size_t dotPos = path.find_last_of('.');
+    if (dotPos == std::string::npos)
+        return path + extension;
+    return path.substr(0, dotPos) + extension;
+}
+
+const char* ImageEngine::EncoderName(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::Png:  return "png";
+    case ImageFormat::WebP: return "libwebp";
+    case ImageFormat::Avif: return "libaom-av1";
+    default:                return "";
+    }
+}
+
+const char* ImageEngine::Extension(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::Jpeg: return ".jpg";
+    case ImageFormat::Png:  return ".png";
+    case ImageFormat::WebP: return ".webp";
+    case ImageFormat::Avif: return ".avif";
+    default:                return "";
+    }
+}
+
+// The supported format that loses least of the source, alpha included.
+AVPixelFormat ImageEngine::SelectPixelFormat(const AVCodec* encoder, AVPixelFormat sourceFormat) {
+    const enum AVPixelFormat* formats = nullptr;
+    int count = 0;
+    if (avcodec_get_supported_config(nullptr, encoder, AV_CODEC_CONFIG_PIX_FORMAT,
+        0, (const void**)&formats, &count) < 0 || !formats || count == 0)
+        return AV_PIX_FMT_NONE;
+
+    for (int i = 0; i < count; ++i) {
+        if (formats[i] == sourceFormat)
+            return sourceFormat;
+    }
+
+    std::vector<AVPixelFormat> list(formats, formats + count);
+    list.push_back(AV_PIX_FMT_NONE);
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(sourceFormat);
+    const int hasAlpha = desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA) ? 1 : 0;
+    return avcodec_find_best_pix_fmt_of_list(list.data(), sourceFormat, hasAlpha, nullptr);
+}
+
+// None of the writers record an orientation, so the pixels are turned
+// instead: the display matrix is read the way the ffmpeg tool's autorotate
+// does and reduced to a transpose plus flips of the output axes.
+bool ImageEngine::ApplyOrientation(AVFrame* frame, int threads) {
+    const AVFrameSideData* side = av_frame_get_side_data(frame, AV_FRAME_DATA_DISPLAYMATRIX);
+    if (!side || side->size < 9 * sizeof(int32_t))
+        return true;
+
+    const int32_t* matrix = reinterpret_cast<const int32_t*>(side->data);
+    double theta = -std::round(av_display_rotation_get(matrix));
+    theta -= 360 * std::floor(theta / 360 + 0.9 / 360);
+
+    bool transpose = false;
+    bool flipX = false;
+    bool flipY = false;
+    if (std::fabs(theta - 90) < 1.0) {
+        transpose = true;
+        flipX = matrix[3] <= 0;
+    }
+    else if (std::fabs(theta - 180) < 1.0) {
+        flipX = matrix[0] < 0;
+        flipY = matrix[4] < 0;
+    }
+    else if (std::fabs(theta - 270) < 1.0) {
+        transpose = true;
+        flipX = matrix[3] < 0;
+        flipY = true;
+    }
+    else if (std::fabs(theta) < 1.0) {
+        flipY = matrix[4] < 0;
+    }
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_DISPLAYMATRIX);
+    if (!transpose && !flipX && !flipY)
+        return true;
+
+    // Pixels are moved whole, so subsampled chroma and bit-packed rows are
+    // first widened to a format with one sample of each plane per pixel.
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+        return false;
+
+    AVFrame* widened = nullptr;
+    if (desc->log2_chroma_w || desc->log2_chroma_h || (desc->flags & AV_PIX_FMT_FLAG_BITSTREAM)) {
+        const bool alpha = desc->flags & AV_PIX_FMT_FLAG_ALPHA;
+        const bool deep = desc->comp[0].depth > 8;
+        AVPixelFormat format = deep ? (alpha ? AV_PIX_FMT_YUVA444P16 : AV_PIX_FMT_YUV444P16)
+                                    : (alpha ? AV_PIX_FMT_YUVA444P : AV_PIX_FMT_YUV444P);
+        if (desc->nb_components == 1)
+            format = AV_PIX_FMT_GRAY8;
+
+        widened = av_frame_alloc();
+        if (widened) {
+            widened->colorspace = frame->colorspace;
+            widened->color_primaries = frame->color_primaries;
+            widened->color_trc = frame->color_trc;
+        }
+        if (!widened || !Convert(frame, format, frame->color_range, threads, widened)) {
+            av_frame_free(&widened);
+            return false;
+        }
+        desc = av_pix_fmt_desc_get(format);
+    }
+    const AVFrame* src = widened ? widened : frame;
+
+    AVFrame* turned = av_frame_alloc();
+    if (!turned) {
+        av_frame_free(&widened);
+        return false;
+    }
+    turned->format = src->format;
+    turned->width = transpose ? src->height : src->width;
+    turned->height = transpose ? src->width : src->height;
+    if (av_frame_get_buffer(turned, 0) < 0 || av_frame_copy_props(turned, frame) < 0) {
+        av_frame_free(&turned);
+        av_frame_free(&widened);
+        return false;
+    }
+
+    for (int plane = 0; plane < av_pix_fmt_count_planes(static_cast<AVPixelFormat>(src->format)); ++plane) {
+        int step = 0;
+        for (int c = 0; c < desc->nb_components; ++c) {
+            if (desc->comp[c].plane == plane)
+                step = std::max(step, desc->comp[c].step);
+        }
+
+        for (int y = 0; y < turned->height; ++y) {
+            uint8_t* row = turned->data[plane] + static_cast<ptrdiff_t>(y) * turned->linesize[plane];
+            for (int x = 0; x < turned->width; ++x) {
+                const int u = flipX ? turned->width - 1 - x : x;
+                const int v = flipY ? turned->height - 1 - y : y;
+                const int sx = transpose ? v : u;
+                const int sy = transpose ? u : v;
+                std::memcpy(row + static_cast<ptrdiff_t>(x) * step,
+                    src->data[plane] + static_cast<ptrdiff_t>(sy) * src->linesize[plane] + static_cast<ptrdiff_t>(sx) * step,
+                    step);
+            }
+        }
+    }
+    if (desc->flags & AV_PIX_FMT_FLAG_PAL)
+        std::memcpy(turned->data[1], src->data[1], AVPALETTE_SIZE);
+
+    if (transpose && turned->sample_aspect_ratio.num > 0)
+        turned->sample_aspect_ratio = { frame->sample_aspect_ratio.den, frame->sample_aspect_ratio.num };
+
+    av_frame_free(&widened);
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, turned);
+    av_frame_free(&turned);
+    return true;
+}
+
+bool ImageEngine::Convert(const AVFrame* src, AVPixelFormat format, AVColorRange range, int threads, AVFrame* dst) {
+    SwsContext* swsCtx = sws_alloc_context();
+    if (!swsCtx)
+        return false;
+
+    swsCtx->flags = SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+    swsCtx->threads = std::max(threads, 1);
+
+    dst->format = format;
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->color_range = range;
+    dst->sample_aspect_ratio = src->sample_aspect_ratio;
+
+    const bool ok = sws_scale_frame(swsCtx, dst, src) >= 0;
+    sws_free_context(&swsCtx);
+    return ok;
+}
+
+void ImageEngine::ApplyQuality(AVCodecContext* encCtx, const ImageOptions& options) {
+    const int quality = std::clamp(options.quality, 1, 100);
+
+    switch (options.format) {
+    case ImageFormat::WebP:
+        if (options.losslessWebP) {
+            av_opt_set_int(encCtx->priv_data, "lossless", 1, 0);
+            encCtx->global_quality = WEBP_LOSSLESS_EFFORT * FF_QP2LAMBDA;
+        }
+        else {
+            encCtx->global_quality = quality * FF_QP2LAMBDA;
+        }
+        break;
+    case ImageFormat::Avif:
+        encCtx->bit_rate = 0;
+        av_opt_set_int(encCtx->priv_data, "crf", AvifCrf(quality), 0);
+        av_opt_set(encCtx->priv_data, "usage", "allintra", 0);
+        av_opt_set_int(encCtx->priv_data, "still-picture", 1, 0);
+        av_opt_set_int(encCtx->priv_data, "cpu-used", AVIF_CPU_USED, 0);
+        av_opt_set_int(encCtx->priv_data, "row-mt", 1, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+
+int ImageEngine::AvifCrf(int quality) {
+    quality = std::clamp(quality, AVIF_ANCHOR_QUALITY[0], AVIF_ANCHOR_QUALITY[3]);
+    for (int i = 1; i < 4; ++i) {
+        if (quality <= AVIF_ANCHOR_QUALITY[i]) {
+            const double t = static_cast<double>(quality - AVIF_ANCHOR_QUALITY[i - 1])
+                / (AVIF_ANCHOR_QUALITY[i] - AVIF_ANCHOR_QUALITY[i - 1]);
+            return static_cast<int>(std::lround(AVIF_CRF[i - 1] + (AVIF_CRF[i] - AVIF_CRF[i - 1]) * t));
+        }
+    }
+    return static_cast<int>(AVIF_CRF[3]);
+}
+
+// AV1 still picture in full-range YUV. Alpha is coded as a second,
+// monochrome AV1 picture, which the avif muxer stores as the alpha item.
+bool ImageEngine::EncodeAvif(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out) {
+    const AVCodec* encoder = avcodec_find_encoder_by_name(EncoderName(ImageFormat::Avif));
+    if (!encoder)
+        return false;
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    const bool hasAlpha = desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA);
+    const bool fullChroma = options.quality >= AVIF_FULL_CHROMA_QUALITY;
+    const AVPixelFormat colorFormat = fullChroma ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P;
+
+    std::vector<AVFrame*> pictures;
+    AVFrame* color = av_frame_alloc();
+    bool ok = color && Convert(frame, hasAlpha ? (fullChroma ? AV_PIX_FMT_YUVA444P : AV_PIX_FMT_YUVA420P) : colorFormat,
+        AVCOL_RANGE_JPEG, options.threads, color);
+    if (color)
+        pictures.push_back(color);
+
+    if (ok && hasAlpha) {
+        AVFrame* alpha = av_frame_alloc();
+        if (alpha)
+            pictures.push_back(alpha);
+        ok = alpha != nullptr;
+        if (ok) {
+            alpha->format = AV_PIX_FMT_GRAY8;
+            alpha->width = color->width;
+            alpha->height = color->height;
+            alpha->color_range = AVCOL_RANGE_JPEG;
+            ok = av_frame_get_buffer(alpha, 0) >= 0;
+        }
+        if (ok) {
+            av_image_copy_plane(alpha->data[0], alpha->linesize[0], color->data[3], color->linesize[3],
+                color->width, color->height);
+            // The colour planes are laid out as in the format without alpha.
+            color->format = colorFormat;
+        }
+    }
+
+    std::vector<AVCodecParameters*> parameters;
+    std::vector<std::vector<uint8_t>> encoded(pictures.size());
+    for (size_t i = 0; ok && i < pictures.size(); ++i) {
+        parameters.push_back(avcodec_parameters_alloc());
+        ok = parameters.back() && RunEncoder(encoder, pictures[i], [&](AVCodecContext* encCtx) {
+            encCtx->thread_count = std::max(options.threads, 1);
+            encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            ApplyQuality(encCtx, options);
+            }, encoded[i], parameters.back());
+    }
+    if (ok)
+        ok = MuxAvif(parameters, encoded, out);
+
+    for (AVCodecParameters*& par : parameters)
+        avcodec_parameters_free(&par);
+    for (AVFrame*& picture : pictures)
+        av_frame_free(&picture);
+    return ok;
+}
+
+// One packet per stream; the first stream is the colour picture and the
+// optional second one its alpha.
+bool ImageEngine::MuxAvif(const std::vector<AVCodecParameters*>& parameters,
+    const std::vector<std::vector<uint8_t>>& pictures, std::vector<uint8_t>& out) {
+    AVFormatContext* fmtCtx = nullptr;
+    if (avformat_alloc_output_context2(&fmtCtx, nullptr, "avif", nullptr) < 0)
+        return false;
+
+    bool ok = true;
+    for (const AVCodecParameters* par : parameters) {
+        AVStream* stream = avformat_new_stream(fmtCtx, nullptr);
+        ok = stream && avcodec_parameters_copy(stream->codecpar, par) >= 0;
+        if (!ok)
+            break;
+        stream->time_base = { 1, 25 };
+    }
+
+    bool headerWritten = false;
+    if (ok)
+        ok = avio_open_dyn_buf(&fmtCtx->pb) >= 0;
+    if (ok)
+        ok = headerWritten = avformat_write_header(fmtCtx, nullptr) >= 0;
+
+    AVPacket* packet = ok ? av_packet_alloc() : nullptr;
+    for (size_t i = 0; ok && i < pictures.size(); ++i) {
+        ok = packet && av_new_packet(packet, static_cast<int>(pictures[i].size())) >= 0;
+        if (!ok)
+            break;
+        memcpy(packet->data, pictures[i].data(), pictures[i].size());
+        packet->stream_index = static_cast<int>(i);
+        packet->pts = 0;
+        packet->dts = 0;
+        packet->duration = av_rescale_q(1, { 1, 25 }, fmtCtx->streams[i]->time_base);
+        packet->flags |= AV_PKT_FLAG_KEY;
+        ok = av_interleaved_write_frame(fmtCtx, packet) >= 0;
+        av_packet_unref(packet);
+    }
+    if (headerWritten)
+        ok = av_write_trailer(fmtCtx) >= 0 && ok;
+
+    if (fmtCtx->pb) {
+        uint8_t* buffer = nullptr;
+        const int size = avio_close_dyn_buf(fmtCtx->pb, &buffer);
+        fmtCtx->pb = nullptr;
+        if (ok && size > 0)
+            out.assign(buffer, buffer + size);
+        av_free(buffer);
+    }
+
+    av_packet_free(&packet);
+    avformat_free_context(fmtCtx);
+    return ok && !out.empty();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// Still-image decode, conversion and encode on libavformat, libavcodec and
+// libswscale. Nothing in here depends on Windows, so the image workload can
+// run on any platform FFmpeg builds for.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+class WorkerPool;
+struct AVFormatContext;
+
+enum class ImageFormat { Jpeg, Png, WebP, Avif, Unknown };
+
+// JPEG chroma resolution; Auto picks it from the picture's colour edges.
+enum class ChromaSubsampling { Auto, Yuv444, Yuv422, Yuv420 };
+
+struct ImageOptions {
+    ImageFormat format = ImageFormat::Unknown;  // Unknown keeps the source's format
+    int quality = 75;   // 1-100, mapped onto each encoder's own scale
+    int threads = 1;    // Shared by the decoder, scaler and encoder
+    WorkerPool* pool = nullptr;  // Runs encode trials in parallel when set
+    bool quantizePng = false;    // Lossy PNG: palette size and error budget from quality
+    bool dither = true;          // Error diffusion when quantising
+    bool losslessWebP = false;   // WebP in its lossless mode, at full effort
+    bool progressiveJpeg = true; // Progressive JPEG scans instead of one baseline scan
+    ChromaSubsampling jpegSubsampling = ChromaSubsampling::Auto;
+    std::vector<ImageFormat> candidates;  // When set, each is encoded and the smallest kept
+};
+
+class ImageEngine {
+public:
+    // Decodes inputPath, re-encodes it as options.format, or as the smallest
+    // of options.candidates, and writes the result to outputPath with the
+    // extension of the format written. The output file is only created once
+    // encoding succeeded. When the source's format is among those tried and
+    // no re-encode is smaller, the source bytes are written instead, as they
+    // are for animated inputs, which a still re-encode would cut to one frame.
+    static bool Compress(const std::string& inputPath, const std::string& outputPath, const ImageOptions& options);
+
+    // Decodes the first picture of the first video stream in path, reporting
+    // which of our formats it was stored in and whether more pictures follow
+    // it. The picture is turned upright as its display matrix (EXIF
+    // Orientation) says.
+    static bool Decode(const std::string& path, int threads, AVFrame* frame, ImageFormat* sourceFormat = nullptr,
+        bool* animated = nullptr);
+
+    // Encodes one picture into a complete in-memory image file.
+    static bool Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out);
+
+    // Opens `encoder` for one picture in its own pixel format, lets configure
+    // set codec options, and collects the packets it produces. When given,
+    // parameters receives the opened encoder's stream parameters.
+    static bool RunEncoder(const AVCodec* encoder, const AVFrame* picture,
+        const std::function<void(AVCodecContext*)>& configure, std::vector<uint8_t>& out,
+        AVCodecParameters* parameters = nullptr);
+
+    static bool ReadFile(const std::string& path, std::vector<uint8_t>& data);
+    static bool WriteFile(const std::string& path, const std::vector<uint8_t>& data);
+
+    static const char* EncoderName(ImageFormat format);
+    static const char* Extension(ImageFormat format);
+
+    // Same-size format conversion into a new picture of the given range.
+    static bool Convert(const AVFrame* src, AVPixelFormat format, AVColorRange range, int threads, AVFrame* dst);
+
+    // Format an image is written in: the requested one, else the source's,
+    // else PNG for pictures with alpha and JPEG for the rest.
+    static ImageFormat OutputFormat(ImageFormat requested, ImageFormat source, const AVFrame* frame);
+
+private:
+    static ImageFormat FormatOf(AVCodecID codecId);
+    static bool IsAnimated(const std::string& path, AVFormatContext* fmtCtx, int streamIdx);
+    static int64_t FileSize(const std::string& path);
+    static std::string ReplaceExtension(const std::string& path, const char* extension);
+    static AVPixelFormat SelectPixelFormat(const AVCodec* encoder, AVPixelFormat sourceFormat);
+    static bool ApplyOrientation(AVFrame* frame, int threads);
+    static void ApplyQuality(AVCodecContext* encCtx, const ImageOptions& options);
+    static int AvifCrf(int quality);
+    static bool EncodeAvif(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out);
+    static bool MuxAvif(const std::vector<AVCodecParameters*>& parameters,
+        const std::vector<std::vector<uint8_t>>& pictures, std::vector<uint8_t>& out);
+};
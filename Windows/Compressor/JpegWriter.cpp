@@ -0,0 +1,622 @@
+#include "JpegWriter.h"
+#include "ImageEngine.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <numbers>
+
+extern "C" {
+#include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/rational.h>
+}
+
+// Zigzag position to natural (row-major) position within a block.
+constexpr int ZIGZAG[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// The example tables of the JPEG standard (Annex K), in natural order, which
+// libjpeg scales by quality.
+constexpr uint8_t LUMA_QUANT[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99,
+};
+constexpr uint8_t CHROMA_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Automatic subsampling: neighbouring chroma samples more than
+// CHROMA_EDGE_STEP apart form an edge that averaging them would smear.
+// Chroma is halved along a direction only while such edges are at most this
+// share of the sample pairs along it, at quality 1, 50, 75 and 100.
+constexpr int CHROMA_EDGE_STEP = 16;
+constexpr int CHROMA_ANCHOR_QUALITY[4] = { 1, 50, 75, 100 };
+constexpr double CHROMA_EDGE_SHARE[4] = { 0.10, 0.04, 0.02, 0.0 };
+
+// Longest end-of-band run a single EOBRUN symbol can carry.
+constexpr int MAX_EOB_RUN = 0x7FFF;
+
+constexpr uint8_t MARKER_SOI = 0xD8;
+constexpr uint8_t MARKER_EOI = 0xD9;
+constexpr uint8_t MARKER_SOF0 = 0xC0;
+constexpr uint8_t MARKER_SOF2 = 0xC2;
+constexpr uint8_t MARKER_DHT = 0xC4;
+constexpr uint8_t MARKER_DQT = 0xDB;
+constexpr uint8_t MARKER_SOS = 0xDA;
+constexpr uint8_t MARKER_APP0 = 0xE0;
+constexpr uint8_t MARKER_APP2 = 0xE2;
+
+// ICC profiles are split over APP2 segments of at most this many bytes.
+constexpr size_t ICC_CHUNK_SIZE = 65519;
+
+// Entropy-coded data: bits are packed from the top, and every 0xFF byte is
+// followed by a stuffed zero so it cannot be read as a marker.
+class JpegWriter::BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void Put(uint32_t value, int count) {
+        if (count == 0)
+            return;
+        buffer = (buffer << count) | (value & ((1u << count) - 1));
+        pending += count;
+        while (pending >= 8) {
+            pending -= 8;
+            const uint8_t byte = static_cast<uint8_t>(buffer >> pending);
+            out.push_back(byte);
+            if (byte == 0xFF)
+                out.push_back(0);
+        }
+        buffer &= (1u << pending) - 1;
+    }
+
+    // Pads the last byte with one bits.
+    void Flush() {
+        if (pending > 0)
+            Put((1u << (8 - pending)) - 1, 8 - pending);
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    uint32_t buffer = 0;
+    int pending = 0;
+};
+
+static int Magnitude(int value) {
+    int bits = 0;
+    for (value = std::abs(value); value; value >>= 1)
+        ++bits;
+    return bits;
+}
+
+bool JpegWriter::Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out) {
+    if (frame->width < 1 || frame->height < 1 || frame->width > 65535 || frame->height > 65535)
+        return false;
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    const bool gray = desc && desc->nb_components <= 2
+        && !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_RGB));
+
+    AVFrame* picture = av_frame_alloc();
+    if (!picture || !ImageEngine::Convert(frame, gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUV444P,
+        AVCOL_RANGE_JPEG, options.threads, picture)) {
+        av_frame_free(&picture);
+        return false;
+    }
+
+    const int quality = std::clamp(options.quality, 1, 100);
+    ChromaSubsampling subsampling = options.jpegSubsampling;
+    if (gray)
+        subsampling = ChromaSubsampling::Yuv444;
+    else if (subsampling == ChromaSubsampling::Auto)
+        subsampling = ChooseSubsampling(picture, quality);
+
+    std::vector<Component> components(gray ? 1 : 3);
+    components[0].h = subsampling == ChromaSubsampling::Yuv444 ? 1 : 2;
+    components[0].v = subsampling == ChromaSubsampling::Yuv420 ? 2 : 1;
+    const int maxH = components[0].h;
+    const int maxV = components[0].v;
+    const int mcusX = (frame->width + 8 * maxH - 1) / (8 * maxH);
+    const int mcusY = (frame->height + 8 * maxV - 1) / (8 * maxV);
+    for (Component& component : components) {
+        component.width = (frame->width * component.h + maxH - 1) / maxH;
+        component.height = (frame->height * component.v + maxV - 1) / maxV;
+        component.blocksWide = mcusX * component.h;
+        component.blocksHigh = mcusY * component.v;
+        component.coefficients.resize(static_cast<size_t>(component.blocksWide) * component.blocksHigh * 64);
+    }
+
+    uint16_t quant[2][64];
+    ScaleQuantTable(LUMA_QUANT, quality, quant[0]);
+    ScaleQuantTable(CHROMA_QUANT, quality, quant[1]);
+
+    // Luma is read in place; subsampled chroma is averaged down first.
+    std::vector<std::vector<uint8_t>> chroma(components.size());
+    std::vector<const uint8_t*> samples(components.size());
+    std::vector<ptrdiff_t> strides(components.size());
+    for (size_t c = 0; c < components.size(); ++c) {
+        if (c == 0 || (maxH == 1 && maxV == 1)) {
+            samples[c] = picture->data[c];
+            strides[c] = picture->linesize[c];
+        }
+        else {
+            Downsample(picture, static_cast<int>(c), maxH, maxV, components[c], chroma[c]);
+            samples[c] = chroma[c].data();
+            strides[c] = components[c].width;
+        }
+    }
+
+    struct Row {
+        int component;
+        int by;
+    };
+    std::vector<Row> rows;
+    for (size_t c = 0; c < components.size(); ++c) {
+        for (int by = 0; by < components[c].blocksHigh; ++by)
+            rows.push_back({ static_cast<int>(c), by });
+    }
+    auto transform = [&](size_t i) {
+        const int c = rows[i].component;
+        TransformRow(samples[c], strides[c], quant[c == 0 ? 0 : 1], components[c], rows[i].by);
+    };
+    if (options.pool) {
+        options.pool->ParallelFor(rows.size(), transform);
+    }
+    else {
+        for (size_t i = 0; i < rows.size(); ++i)
+            transform(i);
+    }
+
+    // Progressive order after jpegtran's: all DC first, then the low luma AC
+    // band for an early preview, chroma, and the rest of luma.
+    std::vector<int> all;
+    for (size_t c = 0; c < components.size(); ++c)
+        all.push_back(static_cast<int>(c));
+    std::vector<Scan> scans;
+    if (!options.progressiveJpeg) {
+        scans.push_back({ all, 0, 63 });
+    }
+    else {
+        scans.push_back({ all, 0, 0 });
+        scans.push_back({ { 0 }, 1, 5 });
+        if (!gray) {
+            scans.push_back({ { 2 }, 1, 63 });
+            scans.push_back({ { 1 }, 1, 63 });
+        }
+        scans.push_back({ { 0 }, 6, 63 });
+    }
+
+    out.clear();
+    WriteHeaders(frame, out);
+    av_frame_free(&picture);
+
+    std::vector<uint8_t> payload;
+    for (int t = 0; t < (gray ? 1 : 2); ++t) {
+        payload.push_back(static_cast<uint8_t>(t));
+        for (int k = 0; k < 64; ++k)
+            payload.push_back(static_cast<uint8_t>(quant[t][ZIGZAG[k]]));
+    }
+    WriteMarker(out, MARKER_DQT, payload);
+
+    payload = {
+        8,
+        static_cast<uint8_t>(frame->height >> 8), static_cast<uint8_t>(frame->height),
+        static_cast<uint8_t>(frame->width >> 8), static_cast<uint8_t>(frame->width),
+        static_cast<uint8_t>(components.size()),
+    };
+    for (size_t c = 0; c < components.size(); ++c) {
+        payload.push_back(static_cast<uint8_t>(c + 1));
+        payload.push_back(static_cast<uint8_t>((components[c].h << 4) | components[c].v));
+        payload.push_back(c == 0 ? 0 : 1);
+    }
+    WriteMarker(out, options.progressiveJpeg ? MARKER_SOF2 : MARKER_SOF0, payload);
+
+    // Each scan is coded twice: once to count its symbols, and once with
+    // Huffman tables built from those counts. Table 0 serves luma and table 1
+    // chroma.
+    for (const Scan& scan : scans) {
+        Frequencies dcFreqs[2] = {};
+        Frequencies acFreqs[2] = {};
+        CodeScan(components, scan, mcusX, mcusY, dcFreqs, acFreqs, nullptr, nullptr, nullptr);
+
+        HuffmanTable dcTables[2];
+        HuffmanTable acTables[2];
+        bool used[2] = {};
+        for (int c : scan.components)
+            used[c == 0 ? 0 : 1] = true;
+
+        payload.clear();
+        for (int t = 0; t < 2; ++t) {
+            if (!used[t])
+                continue;
+            if (scan.ss == 0) {
+                BuildTable(dcFreqs[t], dcTables[t]);
+                WriteHuffmanTable(payload, 0, t, dcTables[t]);
+            }
+            if (scan.se > 0) {
+                BuildTable(acFreqs[t], acTables[t]);
+                WriteHuffmanTable(payload, 1, t, acTables[t]);
+            }
+        }
+        WriteMarker(out, MARKER_DHT, payload);
+
+        payload = { static_cast<uint8_t>(scan.components.size()) };
+        for (int c : scan.components) {
+            const int t = c == 0 ? 0 : 1;
+            payload.push_back(static_cast<uint8_t>(c + 1));
+            payload.push_back(static_cast<uint8_t>((t << 4) | t));
+        }
+        payload.push_back(static_cast<uint8_t>(scan.ss));
+        payload.push_back(static_cast<uint8_t>(scan.se));
+        payload.push_back(0);
+        WriteMarker(out, MARKER_SOS, payload);
+
+        BitWriter writer(out);
+        CodeScan(components, scan, mcusX, mcusY, nullptr, nullptr, dcTables, acTables, &writer);
+        writer.Flush();
+    }
+
+    out.push_back(0xFF);
+    out.push_back(MARKER_EOI);
+    return true;
+}
+
+// Measured on the full-resolution chroma planes of a YUV444P picture.
+ChromaSubsampling JpegWriter::ChooseSubsampling(const AVFrame* picture, int quality) {
+    double limit = CHROMA_EDGE_SHARE[3];
+    for (int i = 1; i < 4; ++i) {
+        if (quality <= CHROMA_ANCHOR_QUALITY[i]) {
+            const double t = static_cast<double>(quality - CHROMA_ANCHOR_QUALITY[i - 1])
+                / (CHROMA_ANCHOR_QUALITY[i] - CHROMA_ANCHOR_QUALITY[i - 1]);
+            limit = CHROMA_EDGE_SHARE[i - 1] + (CHROMA_EDGE_SHARE[i] - CHROMA_EDGE_SHARE[i - 1]) * t;
+            break;
+        }
+    }
+
+    uint64_t horizontalEdges = 0, horizontalPairs = 0;
+    uint64_t verticalEdges = 0, verticalPairs = 0;
+    for (int plane = 1; plane <= 2; ++plane) {
+        const uint8_t* data = picture->data[plane];
+        const ptrdiff_t stride = picture->linesize[plane];
+        for (int y = 0; y < picture->height; ++y) {
+            const uint8_t* row = data + y * stride;
+            for (int x = 0; x + 1 < picture->width; x += 2) {
+                horizontalEdges += std::abs(row[x] - row[x + 1]) > CHROMA_EDGE_STEP;
+                ++horizontalPairs;
+            }
+            if ((y & 1) == 0 && y + 1 < picture->height) {
+                for (int x = 0; x < picture->width; ++x) {
+                    verticalEdges += std::abs(row[x] - row[x + stride]) > CHROMA_EDGE_STEP;
+                    ++verticalPairs;
+                }
+            }
+        }
+    }
+
+    auto exceeds = [limit](uint64_t edges, uint64_t pairs) {
+        return pairs > 0 && static_cast<double>(edges) > limit * static_cast<double>(pairs);
+    };
+    if (exceeds(horizontalEdges, horizontalPairs))
+        return ChromaSubsampling::Yuv444;
+    if (exceeds(verticalEdges, verticalPairs))
+        return ChromaSubsampling::Yuv422;
+    return ChromaSubsampling::Yuv420;
+}
+
+// Box average over factorX x factorY samples, centred like JPEG's own
+// chroma siting; the right and bottom edges average what is there.
+void JpegWriter::Downsample(const AVFrame* picture, int plane, int factorX, int factorY, const Component& component,
+    std::vector<uint8_t>& samples) {
+    samples.resize(static_cast<size_t>(component.width) * component.height);
+    for (int y = 0; y < component.height; ++y) {
+        for (int x = 0; x < component.width; ++x) {
+            int sum = 0;
+            int count = 0;
+            for (int dy = 0; dy < factorY; ++dy) {
+                const int sy = y * factorY + dy;
+                if (sy >= picture->height)
+                    break;
+                const uint8_t* row = picture->data[plane] + static_cast<ptrdiff_t>(sy) * picture->linesize[plane];
+                for (int dx = 0; dx < factorX && x * factorX + dx < picture->width; ++dx) {
+                    sum += row[x * factorX + dx];
+                    ++count;
+                }
+            }
+            samples[static_cast<size_t>(y) * component.width + x] = static_cast<uint8_t>((sum + count / 2) / count);
+        }
+    }
+}
+
+// Forward DCT and quantisation of one row of blocks. Blocks past the
+// component's edge repeat its last column and row.
+void JpegWriter::TransformRow(const uint8_t* samples, ptrdiff_t stride, const uint16_t* quant,
+    Component& component, int by) {
+    static const auto basis = [] {
+        std::array<std::array<double, 8>, 8> table{};
+        for (int u = 0; u < 8; ++u) {
+            const double scale = u == 0 ? std::sqrt(1.0 / 8.0) : std::sqrt(2.0 / 8.0);
+            for (int x = 0; x < 8; ++x)
+                table[u][x] = scale * std::cos((2 * x + 1) * u * std::numbers::pi / 16.0);
+        }
+        return table;
+    }();
+
+    for (int bx = 0; bx < component.blocksWide; ++bx) {
+        double block[8][8];
+        for (int y = 0; y < 8; ++y) {
+            const int sy = std::min(by * 8 + y, component.height - 1);
+            const uint8_t* row = samples + sy * stride;
+            for (int x = 0; x < 8; ++x)
+                block[y][x] = row[std::min(bx * 8 + x, component.width - 1)] - 128.0;
+        }
+
+        double rows[8][8];
+        for (int y = 0; y < 8; ++y) {
+            for (int u = 0; u < 8; ++u) {
+                double sum = 0;
+                for (int x = 0; x < 8; ++x)
+                    sum += basis[u][x] * block[y][x];
+                rows[y][u] = sum;
+            }
+        }
+
+        int16_t* out = component.coefficients.data() + (static_cast<size_t>(by) * component.blocksWide + bx) * 64;
+        for (int k = 0; k < 64; ++k) {
+            const int v = ZIGZAG[k] / 8;
+            const int u = ZIGZAG[k] % 8;
+            double sum = 0;
+            for (int y = 0; y < 8; ++y)
+                sum += basis[v][y] * rows[y][u];
+            const long level = std::lround(sum / quant[ZIGZAG[k]]);
+            out[k] = static_cast<int16_t>(std::clamp(level, k == 0 ? -2047L : -1023L, k == 0 ? 2047L : 1023L));
+        }
+    }
+}
+
+// libjpeg's quality scaling: 5000/q percent below 50, 200-2q above.
+void JpegWriter::ScaleQuantTable(const uint8_t* base, int quality, uint16_t* table) {
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; ++i)
+        table[i] = static_cast<uint16_t>(std::clamp((base[i] * scale + 50) / 100, 1, 255));
+}
+
+// Codes a scan into writer, or only counts its symbols into dcFreqs and
+// acFreqs when writer is null. Progressive AC bands code runs of empty
+// blocks as EOBRUN symbols.
+void JpegWriter::CodeScan(const std::vector<Component>& components, const Scan& scan, int mcusX, int mcusY,
+    Frequencies* dcFreqs, Frequencies* acFreqs, const HuffmanTable* dcTables, const HuffmanTable* acTables,
+    BitWriter* writer) {
+    const bool sequential = scan.ss == 0 && scan.se == 63;
+    int predictions[3] = {};
+    int eobRun = 0;
+
+    auto symbol = [&](bool dc, int table, int value) {
+        if (writer) {
+            const HuffmanTable& huffman = dc ? dcTables[table] : acTables[table];
+            writer->Put(huffman.codes[value], huffman.sizes[value]);
+        }
+        else {
+            ++(dc ? dcFreqs : acFreqs)[table][value];
+        }
+    };
+    auto bits = [&](int value, int count) {
+        if (writer)
+            writer->Put(static_cast<uint32_t>(value < 0 ? value - 1 : value), count);
+    };
+    auto flushEobRun = [&](int table) {
+        if (eobRun == 0)
+            return;
+        const int count = Magnitude(eobRun) - 1;
+        symbol(false, table, count << 4);
+        bits(eobRun, count);
+        eobRun = 0;
+    };
+
+    auto codeBlock = [&](const int16_t* block, int c) {
+        const int table = c == 0 ? 0 : 1;
+        if (scan.ss == 0) {
+            const int diff = block[0] - predictions[c];
+            predictions[c] = block[0];
+            const int count = Magnitude(diff);
+            symbol(true, table, count);
+            bits(diff, count);
+        }
+        if (scan.se == 0)
+            return;
+
+        int run = 0;
+        for (int k = std::max(scan.ss, 1); k <= scan.se; ++k) {
+            const int coefficient = block[k];
+            if (coefficient == 0) {
+                ++run;
+                continue;
+            }
+            if (!sequential)
+                flushEobRun(table);
+            for (; run > 15; run -= 16)
+                symbol(false, table, 0xF0);
+            const int count = Magnitude(coefficient);
+            symbol(false, table, (run << 4) | count);
+            bits(coefficient, count);
+            run = 0;
+        }
+        if (run > 0) {
+            if (sequential) {
+                symbol(false, table, 0x00);
+            }
+            else if (++eobRun == MAX_EOB_RUN) {
+                flushEobRun(table);
+            }
+        }
+    };
+
+    if (scan.components.size() == 1) {
+        const int c = scan.components[0];
+        const Component& component = components[c];
+        const int blocksWide = (component.width + 7) / 8;
+        const int blocksHigh = (component.height + 7) / 8;
+        for (int by = 0; by < blocksHigh; ++by) {
+            for (int bx = 0; bx < blocksWide; ++bx)
+                codeBlock(component.Block(bx, by), c);
+        }
+        flushEobRun(c == 0 ? 0 : 1);
+        return;
+    }
+
+    for (int my = 0; my < mcusY; ++my) {
+        for (int mx = 0; mx < mcusX; ++mx) {
+            for (int c : scan.components) {
+                const Component& component = components[c];
+                for (int v = 0; v < component.v; ++v) {
+                    for (int h = 0; h < component.h; ++h)
+                        codeBlock(component.Block(mx * component.h + h, my * component.v + v), c);
+                }
+            }
+        }
+    }
+}
+
+// Optimal code lengths limited to 16 bits, as in the JPEG standard's Annex
+// K.2. A dummy symbol 256 keeps any real code from being all one bits.
+void JpegWriter::BuildTable(Frequencies freqs, HuffmanTable& table) {
+    int codeSize[257] = {};
+    int others[257];
+    std::fill(others, others + 257, -1);
+    freqs[256] = 1;
+
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        for (int i = 0; i < 257; ++i) {
+            if (freqs[i] && (c1 < 0 || freqs[i] <= freqs[c1]))
+                c1 = i;
+        }
+        for (int i = 0; i < 257; ++i) {
+            if (freqs[i] && i != c1 && (c2 < 0 || freqs[i] <= freqs[c2]))
+                c2 = i;
+        }
+        if (c2 < 0)
+            break;
+
+        freqs[c1] += freqs[c2];
+        freqs[c2] = 0;
+        for (++codeSize[c1]; others[c1] >= 0; ++codeSize[c1])
+            c1 = others[c1];
+        others[c1] = c2;
+        for (++codeSize[c2]; others[c2] >= 0; ++codeSize[c2])
+            c2 = others[c2];
+    }
+
+    int bits[33] = {};
+    for (int i = 0; i < 257; ++i) {
+        if (codeSize[i])
+            ++bits[codeSize[i]];
+    }
+
+    // Shorten codes past 16 bits: each pair at the longest length moves up
+    // one, taking the place of a shorter code that moves down.
+    for (int i = 32; i > 16; --i) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0)
+                --j;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    int longest = 16;
+    while (bits[longest] == 0)
+        --longest;
+    bits[longest]--;  // The dummy symbol's code
+
+    std::fill(std::begin(table.bits), std::end(table.bits), uint8_t{ 0 });
+    for (int i = 1; i <= 16; ++i)
+        table.bits[i] = static_cast<uint8_t>(bits[i]);
+    table.values.clear();
+    for (int size = 1; size <= 32; ++size) {
+        for (int i = 0; i < 256; ++i) {
+            if (codeSize[i] == size)
+                table.values.push_back(static_cast<uint8_t>(i));
+        }
+    }
+
+    // Canonical codes in order of length (Annex C).
+    uint16_t code = 0;
+    size_t next = 0;
+    for (int length = 1; length <= 16; ++length) {
+        for (int i = 0; i < table.bits[length]; ++i) {
+            const uint8_t value = table.values[next++];
+            table.codes[value] = code++;
+            table.sizes[value] = static_cast<uint8_t>(length);
+        }
+        code <<= 1;
+    }
+}
+
+void JpegWriter::WriteMarker(std::vector<uint8_t>& out, uint8_t marker, const std::vector<uint8_t>& payload) {
+    const size_t length = payload.size() + 2;
+    out.push_back(0xFF);
+    out.push_back(marker);
+    out.push_back(static_cast<uint8_t>(length >> 8));
+    out.push_back(static_cast<uint8_t>(length));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// SOI, a JFIF header carrying the pixel aspect ratio, and the ICC profile.
+void JpegWriter::WriteHeaders(const AVFrame* frame, std::vector<uint8_t>& out) {
+    out.push_back(0xFF);
+    out.push_back(MARKER_SOI);
+
+    int densityX = 1, densityY = 1;
+    if (frame->sample_aspect_ratio.num > 0 && frame->sample_aspect_ratio.den > 0)
+        av_reduce(&densityX, &densityY, frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den, 65535);
+    WriteMarker(out, MARKER_APP0, {
+        'J', 'F', 'I', 'F', 0, 1, 2, 0,
+        static_cast<uint8_t>(densityX >> 8), static_cast<uint8_t>(densityX),
+        static_cast<uint8_t>(densityY >> 8), static_cast<uint8_t>(densityY),
+        0, 0,
+    });
+
+    const AVFrameSideData* icc = av_frame_get_side_data(frame, AV_FRAME_DATA_ICC_PROFILE);
+    if (!icc || icc->size == 0)
+        return;
+    const size_t chunks = (icc->size + ICC_CHUNK_SIZE - 1) / ICC_CHUNK_SIZE;
+    if (chunks > 255)
+        return;
+    for (size_t i = 0; i < chunks; ++i) {
+        static const char tag[] = "ICC_PROFILE";
+        std::vector<uint8_t> payload(tag, tag + sizeof(tag));
+        payload.push_back(static_cast<uint8_t>(i + 1));
+        payload.push_back(static_cast<uint8_t>(chunks));
+        const size_t offset = i * ICC_CHUNK_SIZE;
+        const size_t size = std::min(ICC_CHUNK_SIZE, icc->size - offset);
+        payload.insert(payload.end(), icc->data + offset, icc->data + offset + size);
+        WriteMarker(out, MARKER_APP2, payload);
+    }
+}
+
+void JpegWriter::WriteHuffmanTable(std::vector<uint8_t>& payload, int tableClass, int id, const HuffmanTable& table) {
+    payload.push_back(static_cast<uint8_t>((tableClass << 4) | id));
+    payload.insert(payload.end(), table.bits + 1, table.bits + 17);
+    payload.insert(payload.end(), table.values.begin(), table.values.end());
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// JPEG encoder with the entropy-coding options the mjpeg encoder lacks:
+// progressive scans, Huffman tables built for each scan from its own symbol
+// statistics, and 4:4:4, 4:2:2 or 4:2:0 chroma picked from the picture.
+// Quantisation uses the libjpeg tables and quality scale.
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+struct ImageOptions;
+enum class ChromaSubsampling;
+
+class JpegWriter {
+public:
+    // Converts frame to full-range YCbCr (or grey) and encodes it at
+    // options.quality. The block transform runs on options.pool when set.
+    static bool Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out);
+
+private:
+    struct Component {
+        int h = 1;  // Sampling factors
+        int v = 1;
+        int width = 0;   // Samples in this component
+        int height = 0;
+        int blocksWide = 0;  // Block grid, padded to whole MCUs
+        int blocksHigh = 0;
+        std::vector<int16_t> coefficients;  // 64 per block, zigzag order
+
+        const int16_t* Block(int bx, int by) const {
+            return coefficients.data() + (static_cast<size_t>(by) * blocksWide + bx) * 64;
+        }
+    };
+
+    // Components coded together and the zigzag band Ss..Se they carry. 0..63
+    // is a baseline scan; progressive scans split DC from AC.
+    struct Scan {
+        std::vector<int> components;
+        int ss;
+        int se;
+    };
+
+    struct HuffmanTable {
+        uint8_t bits[17] = {};  // Codes of each length 1-16
+        std::vector<uint8_t> values;
+        uint16_t codes[256] = {};
+        uint8_t sizes[256] = {};
+    };
+    using Frequencies = std::array<uint32_t, 257>;
+
+    class BitWriter;
+
+    static ChromaSubsampling ChooseSubsampling(const AVFrame* picture, int quality);
+    static void Downsample(const AVFrame* picture, int plane, int factorX, int factorY, const Component& component,
+        std::vector<uint8_t>& samples);
+    static void TransformRow(const uint8_t* samples, ptrdiff_t stride, const uint16_t* quant, Component& component, int by);
+    static void ScaleQuantTable(const uint8_t* base, int quality, uint16_t* table);
+    static void CodeScan(const std::vector<Component>& components, const Scan& scan, int mcusX, int mcusY,
+        Frequencies* dcFreqs, Frequencies* acFreqs, const HuffmanTable* dcTables, const HuffmanTable* acTables,
+        BitWriter* writer);
+    static void BuildTable(Frequencies freqs, HuffmanTable& table);
+
+    static void WriteMarker(std::vector<uint8_t>& out, uint8_t marker, const std::vector<uint8_t>& payload);
+    static void WriteHeaders(const AVFrame* frame, std::vector<uint8_t>& out);
+    static void WriteHuffmanTable(std::vector<uint8_t>& payload, int tableClass, int id, const HuffmanTable& table);
+};
@@ -0,0 +1,291 @@
+#include "PaletteQuantizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+// RGBA histogram cells: 5 bits per premultiplied colour channel and 4 bits of
+// alpha, so differently coloured fully transparent pixels land in one cell.
+constexpr int RGBA_CELL_BITS = 19;
+constexpr int RGBA_CELLS = 1 << RGBA_CELL_BITS;
+
+// Distances in lossy quantisation weigh green highest and blue lowest, as
+// the eye is most sensitive to green, and alpha like green.
+constexpr double PERCEPTUAL_WEIGHTS[4] = { 0.5, 1.0, 0.45, 1.0 };
+constexpr int QUANTIZE_REFINE_ITERATIONS = 3;
+
+// Share of each pixel's remapping error that dithering passes on, and the
+// largest error carried per channel, so flat areas do not pick up noise
+// from a single far-off pixel.
+constexpr double DITHER_STRENGTH = 0.8;
+constexpr double DITHER_MAX_ERROR = 24.0;
+
+static double WeightedDistance(const double* a, const double* b, const double (&weights)[4]) {
+    double distance = 0;
+    for (int ch = 0; ch < 4; ++ch) {
+        const double d = a[ch] - b[ch];
+        distance += d * d * weights[ch];
+    }
+    return distance;
+}
+
+std::vector<PaletteQuantizer::Centroid> PaletteQuantizer::MedianCut(std::vector<PaletteColor>& colors, int maxColors,
+    const double (&weights)[4], int refineIterations) {
+    struct Box {
+        size_t begin;
+        size_t end;
+    };
+
+    std::vector<Centroid> centroids;
+    if (colors.empty() || maxColors < 1)
+        return centroids;
+
+    // Repeatedly split the box whose widest weighted channel range, scaled by
+    // its population, is largest, at the population median of that channel
+    std::vector<Box> boxes{ { 0, colors.size() } };
+    while (static_cast<int>(boxes.size()) < maxColors) {
+        int best = -1;
+        int bestChannel = 0;
+        double bestScore = 0;
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            if (boxes[i].end - boxes[i].begin < 2)
+                continue;
+            double lo[4] = { 1e30, 1e30, 1e30, 1e30 };
+            double hi[4] = { -1e30, -1e30, -1e30, -1e30 };
+            uint64_t population = 0;
+            for (size_t j = boxes[i].begin; j < boxes[i].end; ++j) {
+                for (int ch = 0; ch < 4; ++ch) {
+                    lo[ch] = std::min(lo[ch], colors[j].c[ch]);
+                    hi[ch] = std::max(hi[ch], colors[j].c[ch]);
+                }
+                population += colors[j].count;
+            }
+            for (int ch = 0; ch < 4; ++ch) {
+                const double score = (hi[ch] - lo[ch]) * std::sqrt(weights[ch]) * static_cast<double>(population);
+                if (score > bestScore) {
+                    bestScore = score;
+                    best = static_cast<int>(i);
+                    bestChannel = ch;
+                }
+            }
+        }
+        if (best < 0)
+            break;
+
+        const Box box = boxes[best];
+        std::sort(colors.begin() + box.begin, colors.begin() + box.end,
+            [&](const PaletteColor& a, const PaletteColor& b) { return a.c[bestChannel] < b.c[bestChannel]; });
+
+        uint64_t population = 0;
+        for (size_t j = box.begin; j < box.end; ++j)
+            population += colors[j].count;
+        uint64_t seen = 0;
+        size_t split = box.begin + 1;
+        for (size_t j = box.begin; j < box.end - 1; ++j) {
+            seen += colors[j].count;
+            split = j + 1;
+            if (seen * 2 >= population)
+                break;
+        }
+
+        boxes[best] = { box.begin, split };
+        boxes.push_back({ split, box.end });
+    }
+
+    const size_t count = boxes.size();
+    centroids.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        double sum[4] = {};
+        double weight = 0;
+        for (size_t j = boxes[i].begin; j < boxes[i].end; ++j) {
+            for (int ch = 0; ch < 4; ++ch)
+                sum[ch] += colors[j].c[ch] * colors[j].count;
+            weight += static_cast<double>(colors[j].count);
+        }
+        for (int ch = 0; ch < 4; ++ch)
+            centroids[i][ch] = sum[ch] / weight;
+    }
+
+    for (int iteration = 0; iteration < refineIterations; ++iteration) {
+        std::vector<Centroid> sums(count, Centroid{});
+        std::vector<double> totals(count);
+        for (const PaletteColor& color : colors) {
+            size_t nearest = 0;
+            double nearestDistance = 1e30;
+            for (size_t i = 0; i < count; ++i) {
+                const double distance = WeightedDistance(color.c, centroids[i].data(), weights);
+                if (distance < nearestDistance) {
+                    nearestDistance = distance;
+                    nearest = i;
+                }
+            }
+            for (int ch = 0; ch < 4; ++ch)
+                sums[nearest][ch] += color.c[ch] * color.count;
+            totals[nearest] += static_cast<double>(color.count);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (totals[i] == 0)
+                continue;
+            for (int ch = 0; ch < 4; ++ch)
+                centroids[i][ch] = sums[i][ch] / totals[i];
+        }
+    }
+    return centroids;
+}
+
+// Quantisation works on premultiplied colour, where the colour of a pixel
+// counts in proportion to how visible it is.
+bool PaletteQuantizer::Quantize(const uint8_t* rgba, int width, int height, const QuantizeOptions& options,
+    uint32_t* palette, int& paletteSize, uint8_t* indices) {
+    struct CellSum {
+        uint64_t sum[4];
+        uint64_t count;
+    };
+
+    auto premultiply = [](const uint8_t* px, double* out) {
+        const double alpha = px[3] / 255.0;
+        out[0] = px[0] * alpha;
+        out[1] = px[1] * alpha;
+        out[2] = px[2] * alpha;
+        out[3] = px[3];
+    };
+    auto cellOf = [](const double* c) {
+        auto bits = [](double v, int shift) { return static_cast<uint32_t>(std::clamp(v, 0.0, 255.0)) >> shift; };
+        return (bits(c[0], 3) << 14) | (bits(c[1], 3) << 9) | (bits(c[2], 3) << 4) | bits(c[3], 4);
+    };
+
+    const size_t pixelCount = static_cast<size_t>(width) * height;
+    std::vector<CellSum> cells(RGBA_CELLS);
+    uint64_t transparent = 0;
+    for (size_t i = 0; i < pixelCount; ++i) {
+        const uint8_t* px = rgba + i * 4;
+        if (px[3] == 0) {
+            ++transparent;
+            continue;
+        }
+        double c[4];
+        premultiply(px, c);
+        CellSum& cell = cells[cellOf(c)];
+        for (int ch = 0; ch < 4; ++ch)
+            cell.sum[ch] += static_cast<uint64_t>(std::lround(c[ch]));
+        ++cell.count;
+    }
+
+    std::vector<PaletteColor> colors;
+    for (const CellSum& cell : cells) {
+        if (cell.count == 0)
+            continue;
+        PaletteColor color;
+        for (int ch = 0; ch < 4; ++ch)
+            color.c[ch] = static_cast<double>(cell.sum[ch]) / cell.count;
+        color.count = cell.count;
+        colors.push_back(color);
+    }
+
+    const int reserved = transparent > 0 ? 1 : 0;
+    const int maxColors = std::clamp(options.maxColors, 2, 256) - reserved;
+    std::vector<Centroid> centroids = MedianCut(colors, maxColors, PERCEPTUAL_WEIGHTS, QUANTIZE_REFINE_ITERATIONS);
+
+    // Palette entry 0 is the shared fully transparent one when needed; the
+    // premultiplied values of each entry are kept for remapping.
+    std::vector<Centroid> entries;
+    if (reserved)
+        entries.push_back(Centroid{});
+    for (const Centroid& centroid : centroids) {
+        const double alpha = std::clamp(std::round(centroid[3]), 1.0, 255.0);
+        uint32_t argb = static_cast<uint32_t>(alpha) << 24;
+        Centroid premultiplied{};
+        for (int ch = 0; ch < 3; ++ch) {
+            const double value = std::clamp(std::round(centroid[ch] * 255.0 / alpha), 0.0, 255.0);
+            argb |= static_cast<uint32_t>(value) << (16 - ch * 8);
+            premultiplied[ch] = value * alpha / 255.0;
+        }
+        premultiplied[3] = alpha;
+        palette[entries.size()] = argb;
+        entries.push_back(premultiplied);
+    }
+    if (reserved)
+        palette[0] = 0x00000000;
+    paletteSize = static_cast<int>(entries.size());
+
+    auto nearestEntry = [&](const double* c) {
+        int nearest = reserved;
+        double nearestDistance = 1e30;
+        for (int i = reserved; i < paletteSize; ++i) {
+            const double distance = WeightedDistance(c, entries[i].data(), PERCEPTUAL_WEIGHTS);
+            if (distance < nearestDistance) {
+                nearestDistance = distance;
+                nearest = i;
+            }
+        }
+        return nearest;
+    };
+
+    // The error budget is checked on the histogram: each cell's mean colour
+    // against its nearest entry, weighted by the pixels in the cell.
+    if (options.maxError > 0 && pixelCount > 0) {
+        double error = 0;
+        for (const PaletteColor& color : colors)
+            error += WeightedDistance(color.c, entries[nearestEntry(color.c)].data(), PERCEPTUAL_WEIGHTS) * color.count;
+        if (error / pixelCount > options.maxError)
+            return false;
+    }
+
+    // Nearest entry per histogram cell, filled in as cells are met.
+    std::vector<int16_t> lut(RGBA_CELLS, -1);
+    auto lookup = [&](const double* c) {
+        const uint32_t cell = cellOf(c);
+        if (lut[cell] < 0)
+            lut[cell] = static_cast<int16_t>(nearestEntry(c));
+        return lut[cell];
+    };
+
+    if (!options.dither) {
+        for (size_t i = 0; i < pixelCount; ++i) {
+            const uint8_t* px = rgba + i * 4;
+            if (px[3] == 0) {
+                indices[i] = 0;
+                continue;
+            }
+            double c[4];
+            premultiply(px, c);
+            indices[i] = static_cast<uint8_t>(lookup(c));
+        }
+        return true;
+    }
+
+    // Floyd-Steinberg on the colour channels only; alpha is never diffused,
+    // so opaque areas stay opaque and transparent ones stay clean.
+    std::vector<double> errors(static_cast<size_t>(width + 2) * 3 * 2);
+    double* current = errors.data();
+    double* next = errors.data() + static_cast<size_t>(width + 2) * 3;
+    for (int y = 0; y < height; ++y) {
+        std::fill(next, next + static_cast<size_t>(width + 2) * 3, 0.0);
+        for (int x = 0; x < width; ++x) {
+            const size_t i = static_cast<size_t>(y) * width + x;
+            const uint8_t* px = rgba + i * 4;
+            if (px[3] == 0) {
+                indices[i] = 0;
+                continue;
+            }
+
+            double c[4];
+            premultiply(px, c);
+            double* err = current + (x + 1) * 3;
+            for (int ch = 0; ch < 3; ++ch)
+                c[ch] = std::clamp(c[ch] + err[ch], 0.0, c[3]);
+
+            const int index = lookup(c);
+            indices[i] = static_cast<uint8_t>(index);
+            for (int ch = 0; ch < 3; ++ch) {
+                const double e = std::clamp((c[ch] - entries[index][ch]) * DITHER_STRENGTH,
+                    -DITHER_MAX_ERROR, DITHER_MAX_ERROR);
+                err[3 + ch] += e * 7 / 16;
+                next[x * 3 + ch] += e * 3 / 16;
+                next[(x + 1) * 3 + ch] += e * 5 / 16;
+                next[(x + 2) * 3 + ch] += e * 1 / 16;
+            }
+        }
+        std::swap(current, next);
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Colour quantisation shared by GIF palettes and lossy PNG: median cut over a
+// weighted colour histogram refined by k-means, and RGBA remapping with
+// optional Floyd-Steinberg dithering.
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// One histogram entry: mean R, G, B, A of the pixels it stands for.
+struct PaletteColor {
+    double c[4];
+    uint64_t count;
+};
+
+struct QuantizeOptions {
+    int maxColors = 256;
+    double maxError = 0;  // Mean weighted squared error per pixel allowed, 0 = no limit
+    bool dither = true;
+};
+
+class PaletteQuantizer {
+public:
+    using Centroid = std::array<double, 4>;
+
+    // Median cut over colors followed by refineIterations k-means passes,
+    // with squared channel differences scaled by weights. Reorders colors and
+    // returns at most maxColors centroids.
+    static std::vector<Centroid> MedianCut(std::vector<PaletteColor>& colors, int maxColors,
+        const double (&weights)[4], int refineIterations);
+
+    // Reduces tightly packed RGBA pixels to at most options.maxColors
+    // 0xAARRGGBB palette entries and one index per pixel. Fully transparent
+    // pixels share one reserved entry. Returns false when the palette cannot
+    // stay within options.maxError.
+    static bool Quantize(const uint8_t* rgba, int width, int height, const QuantizeOptions& options,
+        uint32_t* palette, int& paletteSize, uint8_t* indices);
+};
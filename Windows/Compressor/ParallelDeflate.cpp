@@ -0,0 +1,511 @@
+#include "ParallelDeflate.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <queue>
+
+extern "C" {
+#include <libavutil/adler32.h>
+}
+
+// Input bytes per independently compressed piece. Pieces only lose the
+// block split at their edges, since each one sees the previous 32 KiB.
+constexpr size_t DEFLATE_PIECE_SIZE = 256 * 1024;
+constexpr size_t DEFLATE_WINDOW = 32768;
+
+// Match search: 3-byte hash chains, at most MAX_CHAIN candidates per position,
+// stopping early at NICE_MATCH bytes. Matches shorter than LAZY_MATCH are
+// held back one byte in case the next position matches longer, and 3-byte
+// matches further than FAR_MATCH cost more than the literals they replace.
+// The settings sit between zlib levels 6 and 9 in both size and speed.
+constexpr int HASH_BITS = 15;
+constexpr int MIN_MATCH = 3;
+constexpr int MAX_MATCH = 258;
+constexpr int MAX_CHAIN = 1024;
+constexpr int NICE_MATCH = 258;
+constexpr int LAZY_MATCH = 258;
+constexpr int FAR_MATCH = 4096;
+
+// Symbols per Huffman block; each block gets its own code tables.
+constexpr size_t BLOCK_SYMBOLS = 32768;
+
+constexpr int LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+constexpr int LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+constexpr int DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+constexpr int DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+constexpr uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Deflate streams are written least significant bit first.
+class ParallelDeflate::BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void Put(uint32_t value, int count) {
+        bits |= static_cast<uint64_t>(value) << filled;
+        filled += count;
+        while (filled >= 8) {
+            out.push_back(static_cast<uint8_t>(bits));
+            bits >>= 8;
+            filled -= 8;
+        }
+    }
+
+    void Align() {
+        if (filled > 0)
+            out.push_back(static_cast<uint8_t>(bits));
+        bits = 0;
+        filled = 0;
+    }
+
+    // Only valid on a byte boundary.
+    void Bytes(const uint8_t* data, size_t size) {
+        out.insert(out.end(), data, data + size);
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int filled = 0;
+};
+
+void ParallelDeflate::Compress(const uint8_t* data, size_t size, WorkerPool* pool, std::vector<uint8_t>& out) {
+    const size_t pieceCount = std::max<size_t>(1, (size + DEFLATE_PIECE_SIZE - 1) / DEFLATE_PIECE_SIZE);
+    std::vector<std::vector<uint8_t>> pieces(pieceCount);
+    std::vector<uint32_t> checksums(pieceCount);
+
+    auto compressPiece = [&](size_t i) {
+        const size_t begin = i * DEFLATE_PIECE_SIZE;
+        const size_t end = std::min(size, begin + DEFLATE_PIECE_SIZE);
+        CompressPiece(data, begin, end, i + 1 == pieceCount, pieces[i]);
+        checksums[i] = av_adler32_update(1, data + begin, end - begin);
+    };
+    if (pool) {
+        pool->ParallelFor(pieceCount, compressPiece);
+    }
+    else {
+        for (size_t i = 0; i < pieceCount; ++i)
+            compressPiece(i);
+    }
+
+    // 32 KiB window, maximum compression
+    out.push_back(0x78);
+    out.push_back(0xDA);
+
+    uint32_t adler = 1;
+    for (size_t i = 0; i < pieceCount; ++i) {
+        out.insert(out.end(), pieces[i].begin(), pieces[i].end());
+        const size_t begin = i * DEFLATE_PIECE_SIZE;
+        adler = CombineAdler(adler, checksums[i], std::min(size, begin + DEFLATE_PIECE_SIZE) - begin);
+    }
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(adler >> shift));
+}
+
+// LZ77 over data[begin, end) with lazy matching. The window reaches back into
+// the previous piece, but only this piece's bytes are emitted.
+void ParallelDeflate::CompressPiece(const uint8_t* data, size_t begin, size_t end, bool last, std::vector<uint8_t>& out) {
+    struct Match {
+        int length = 0;
+        int distance = 0;
+    };
+
+    const size_t windowStart = begin > DEFLATE_WINDOW ? begin - DEFLATE_WINDOW : 0;
+    std::vector<int32_t> head(size_t(1) << HASH_BITS, -1);
+    std::vector<int32_t> prev(end - windowStart, -1);
+
+    auto hash = [data](size_t p) {
+        const uint32_t bytes = data[p] | (static_cast<uint32_t>(data[p + 1]) << 8) | (static_cast<uint32_t>(data[p + 2]) << 16);
+        return (bytes * 2654435761u) >> (32 - HASH_BITS);
+    };
+    auto insert = [&](size_t p) {
+        if (p + MIN_MATCH > end)
+            return;
+        const uint32_t h = hash(p);
+        prev[p - windowStart] = head[h];
+        head[h] = static_cast<int32_t>(p - windowStart);
+    };
+    auto find = [&](size_t p) {
+        Match best;
+        const size_t maxLength = std::min<size_t>(MAX_MATCH, end - p);
+        if (maxLength < MIN_MATCH)
+            return best;
+
+        const uint8_t* current = data + p;
+        int32_t candidate = head[hash(p)];
+        for (int chain = MAX_CHAIN; candidate >= 0 && chain > 0; --chain) {
+            const size_t distance = p - (windowStart + candidate);
+            if (distance > DEFLATE_WINDOW)
+                break;
+            const uint8_t* ref = current - distance;
+            if (ref[best.length] == current[best.length]) {
+                size_t length = 0;
+                while (length < maxLength && ref[length] == current[length])
+                    ++length;
+                if (static_cast<int>(length) > best.length) {
+                    best = { static_cast<int>(length), static_cast<int>(distance) };
+                    if (best.length >= NICE_MATCH || length == maxLength)
+                        break;
+                }
+            }
+            candidate = prev[candidate];
+        }
+        if (best.length < MIN_MATCH || (best.length == MIN_MATCH && best.distance > FAR_MATCH))
+            best = {};
+        return best;
+    };
+
+    for (size_t p = windowStart; p < begin; ++p)
+        insert(p);
+
+    BitWriter writer(out);
+    std::vector<Symbol> symbols;
+    symbols.reserve(BLOCK_SYMBOLS);
+    size_t blockStart = begin;
+    Match next;
+    size_t nextPos = SIZE_MAX;
+
+    size_t p = begin;
+    while (p < end) {
+        const Match match = nextPos == p ? next : find(p);
+        insert(p);
+
+        bool deferred = false;
+        if (match.length >= MIN_MATCH && match.length < LAZY_MATCH && p + 1 < end) {
+            next = find(p + 1);
+            nextPos = p + 1;
+            deferred = next.length > match.length;
+        }
+
+        if (match.length >= MIN_MATCH && !deferred) {
+            symbols.push_back({ static_cast<uint16_t>(match.length), static_cast<uint16_t>(match.distance) });
+            for (size_t q = p + 1; q < p + match.length; ++q)
+                insert(q);
+            p += match.length;
+        }
+        else {
+            symbols.push_back({ 0, data[p] });
+            ++p;
+        }
+
+        if (symbols.size() >= BLOCK_SYMBOLS) {
+            WriteBlock(writer, symbols, data + blockStart, p - blockStart, false);
+            symbols.clear();
+            blockStart = p;
+        }
+    }
+
+    if (!symbols.empty() || last)
+        WriteBlock(writer, symbols, data + blockStart, end - blockStart, last);
+
+    // Empty stored block: byte-aligns the piece so the next one can follow it
+    if (!last) {
+        writer.Put(0, 3);
+        writer.Align();
+        writer.Put(0x0000, 16);
+        writer.Put(0xFFFF, 16);
+    }
+    writer.Align();
+}
+
+// Writes symbols as whichever of a dynamic Huffman, fixed Huffman or stored
+// block is smallest.
+void ParallelDeflate::WriteBlock(BitWriter& writer, const std::vector<Symbol>& symbols,
+    const uint8_t* raw, size_t rawSize, bool last) {
+    uint32_t litFreqs[288] = {};
+    uint32_t distFreqs[30] = {};
+    for (const Symbol& symbol : symbols) {
+        if (symbol.length == 0) {
+            ++litFreqs[symbol.value];
+        }
+        else {
+            ++litFreqs[257 + LengthCode(symbol.length)];
+            ++distFreqs[DistanceCode(symbol.value)];
+        }
+    }
+    litFreqs[256] = 1;
+
+    // Give each code at least two symbols so it is complete, which every
+    // inflater accepts; the unused ones cost a bit of header at most.
+    auto ensureTwo = [](uint32_t* freqs, int count) {
+        int used = 0;
+        for (int i = 0; i < count; ++i)
+            used += freqs[i] ? 1 : 0;
+        for (int i = 0; used < 2 && i < count; ++i) {
+            if (!freqs[i]) {
+                freqs[i] = 1;
+                ++used;
+            }
+        }
+    };
+    ensureTwo(litFreqs, 286);
+    ensureTwo(distFreqs, 30);
+
+    uint8_t litLengths[288] = {};
+    uint8_t distLengths[30] = {};
+    BuildLengths(litFreqs, 286, 15, litLengths);
+    BuildLengths(distFreqs, 30, 15, distLengths);
+
+    int litCount = 286;
+    while (litCount > 257 && litLengths[litCount - 1] == 0)
+        --litCount;
+    int distCount = 30;
+    while (distCount > 1 && distLengths[distCount - 1] == 0)
+        --distCount;
+
+    // Run-length code both length tables as one sequence: 16 repeats the
+    // previous length 3-6 times, 17 and 18 give 3-10 and 11-138 zeros.
+    struct Run {
+        uint8_t symbol;
+        uint8_t extra;
+    };
+    std::vector<uint8_t> sequence(litLengths, litLengths + litCount);
+    sequence.insert(sequence.end(), distLengths, distLengths + distCount);
+    std::vector<Run> runs;
+    for (size_t i = 0; i < sequence.size();) {
+        const uint8_t length = sequence[i];
+        size_t run = 1;
+        while (i + run < sequence.size() && sequence[i + run] == length)
+            ++run;
+        i += run;
+
+        size_t left = run;
+        if (length == 0) {
+            while (left >= 11) {
+                const size_t n = std::min<size_t>(left, 138);
+                runs.push_back({ 18, static_cast<uint8_t>(n - 11) });
+                left -= n;
+            }
+            if (left >= 3) {
+                runs.push_back({ 17, static_cast<uint8_t>(left - 3) });
+                left = 0;
+            }
+        }
+        else if (left >= 4) {
+            runs.push_back({ length, 0 });
+            --left;
+            while (left >= 3) {
+                const size_t n = std::min<size_t>(left, 6);
+                runs.push_back({ 16, static_cast<uint8_t>(n - 3) });
+                left -= n;
+            }
+        }
+        for (; left > 0; --left)
+            runs.push_back({ length, 0 });
+    }
+
+    uint32_t codeLengthFreqs[19] = {};
+    for (const Run& run : runs)
+        ++codeLengthFreqs[run.symbol];
+    ensureTwo(codeLengthFreqs, 19);
+    uint8_t codeLengthLengths[19] = {};
+    BuildLengths(codeLengthFreqs, 19, 7, codeLengthLengths);
+    int codeLengthCount = 19;
+    while (codeLengthCount > 4 && codeLengthLengths[CODE_LENGTH_ORDER[codeLengthCount - 1]] == 0)
+        --codeLengthCount;
+
+    auto runExtraBits = [](uint8_t symbol) { return symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0; };
+    auto fixedLitLength = [](int i) { return i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8; };
+
+    uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * static_cast<uint64_t>(codeLengthCount);
+    for (const Run& run : runs)
+        dynamicBits += codeLengthLengths[run.symbol] + runExtraBits(run.symbol);
+    uint64_t fixedBits = 3;
+    for (int i = 0; i < 286; ++i) {
+        const uint64_t extra = i > 256 ? LENGTH_EXTRA[i - 257] : 0;
+        dynamicBits += litFreqs[i] * (litLengths[i] + extra);
+        fixedBits += litFreqs[i] * (fixedLitLength(i) + extra);
+    }
+    for (int i = 0; i < 30; ++i) {
+        dynamicBits += distFreqs[i] * static_cast<uint64_t>(distLengths[i] + DIST_EXTRA[i]);
+        fixedBits += distFreqs[i] * static_cast<uint64_t>(5 + DIST_EXTRA[i]);
+    }
+    const uint64_t storedBits = (rawSize / 65535 + 1) * 48 + static_cast<uint64_t>(rawSize) * 8;
+
+    if (storedBits < std::min(dynamicBits, fixedBits)) {
+        size_t offset = 0;
+        do {
+            const size_t n = std::min<size_t>(rawSize - offset, 65535);
+            writer.Put(last && offset + n == rawSize ? 1 : 0, 1);
+            writer.Put(0, 2);
+            writer.Align();
+            writer.Put(static_cast<uint32_t>(n), 16);
+            writer.Put(static_cast<uint32_t>(~n & 0xFFFF), 16);
+            writer.Bytes(raw + offset, n);
+            offset += n;
+        } while (offset < rawSize);
+        return;
+    }
+
+    uint16_t litCodes[288] = {};
+    uint16_t distCodes[30] = {};
+    writer.Put(last ? 1 : 0, 1);
+    if (fixedBits <= dynamicBits) {
+        for (int i = 0; i < 288; ++i)
+            litLengths[i] = static_cast<uint8_t>(fixedLitLength(i));
+        std::fill(distLengths, distLengths + 30, 5);
+        writer.Put(1, 2);
+    }
+    else {
+        uint16_t codeLengthCodes[19] = {};
+        AssignCodes(codeLengthLengths, 19, codeLengthCodes);
+        writer.Put(2, 2);
+        writer.Put(litCount - 257, 5);
+        writer.Put(distCount - 1, 5);
+        writer.Put(codeLengthCount - 4, 4);
+        for (int i = 0; i < codeLengthCount; ++i)
+            writer.Put(codeLengthLengths[CODE_LENGTH_ORDER[i]], 3);
+        for (const Run& run : runs) {
+            writer.Put(codeLengthCodes[run.symbol], codeLengthLengths[run.symbol]);
+            writer.Put(run.extra, runExtraBits(run.symbol));
+        }
+    }
+    AssignCodes(litLengths, 288, litCodes);
+    AssignCodes(distLengths, 30, distCodes);
+
+    for (const Symbol& symbol : symbols) {
+        if (symbol.length == 0) {
+            writer.Put(litCodes[symbol.value], litLengths[symbol.value]);
+            continue;
+        }
+        const int lengthCode = LengthCode(symbol.length);
+        writer.Put(litCodes[257 + lengthCode], litLengths[257 + lengthCode]);
+        writer.Put(symbol.length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+        const int distCode = DistanceCode(symbol.value);
+        writer.Put(distCodes[distCode], distLengths[distCode]);
+        writer.Put(symbol.value - DIST_BASE[distCode], DIST_EXTRA[distCode]);
+    }
+    writer.Put(litCodes[256], litLengths[256]);
+}
+
+// Huffman code lengths for freqs, no longer than maxBits. Over-long trees are
+// rebuilt from halved frequencies, which flattens them until they fit.
+void ParallelDeflate::BuildLengths(const uint32_t* freqs, int count, int maxBits, uint8_t* lengths) {
+    struct Node {
+        uint64_t weight;
+        int left;   // -1 for a leaf
+        int right;  // Symbol of a leaf
+    };
+    using Entry = std::pair<uint64_t, int>;
+
+    std::vector<uint64_t> weights(freqs, freqs + count);
+    for (;;) {
+        std::fill(lengths, lengths + count, 0);
+        std::vector<Node> nodes;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        for (int i = 0; i < count; ++i) {
+            if (weights[i] == 0)
+                continue;
+            nodes.push_back({ weights[i], -1, i });
+            queue.push({ weights[i], static_cast<int>(nodes.size()) - 1 });
+        }
+        if (nodes.empty())
+            return;
+        if (nodes.size() == 1) {
+            lengths[nodes[0].right] = 1;
+            return;
+        }
+
+        while (queue.size() > 1) {
+            const Entry a = queue.top();
+            queue.pop();
+            const Entry b = queue.top();
+            queue.pop();
+            nodes.push_back({ a.first + b.first, a.second, b.second });
+            queue.push({ a.first + b.first, static_cast<int>(nodes.size()) - 1 });
+        }
+
+        int deepest = 0;
+        std::vector<std::pair<int, int>> stack{ { static_cast<int>(nodes.size()) - 1, 0 } };
+        while (!stack.empty()) {
+            const auto [node, depth] = stack.back();
+            stack.pop_back();
+            if (nodes[node].left < 0) {
+                lengths[nodes[node].right] = static_cast<uint8_t>(std::min(depth, 255));
+                deepest = std::max(deepest, depth);
+            }
+            else {
+                stack.push_back({ nodes[node].left, depth + 1 });
+                stack.push_back({ nodes[node].right, depth + 1 });
+            }
+        }
+        if (deepest <= maxBits)
+            return;
+
+        for (auto& weight : weights) {
+            if (weight)
+                weight = (weight + 1) / 2;
+        }
+    }
+}
+
+// Canonical codes (RFC 1951 3.2.2), stored bit-reversed for the LSB-first writer.
+void ParallelDeflate::AssignCodes(const uint8_t* lengths, int count, uint16_t* codes) {
+    int lengthCounts[16] = {};
+    for (int i = 0; i < count; ++i)
+        ++lengthCounts[lengths[i]];
+    lengthCounts[0] = 0;
+
+    int nextCode[16] = {};
+    int code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const int length = lengths[i];
+        if (length == 0) {
+            codes[i] = 0;
+            continue;
+        }
+        uint32_t value = nextCode[length]++;
+        uint16_t reversed = 0;
+        for (int bit = 0; bit < length; ++bit, value >>= 1)
+            reversed = static_cast<uint16_t>((reversed << 1) | (value & 1));
+        codes[i] = reversed;
+    }
+}
+
+int ParallelDeflate::LengthCode(int length) {
+    static const auto table = [] {
+        std::array<uint8_t, MAX_MATCH + 1> codes{};
+        int code = 0;
+        for (int len = MIN_MATCH; len <= MAX_MATCH; ++len) {
+            while (code + 1 < 29 && len >= LENGTH_BASE[code + 1])
+                ++code;
+            codes[len] = static_cast<uint8_t>(code);
+        }
+        return codes;
+    }();
+    return table[length];
+}
+
+int ParallelDeflate::DistanceCode(int distance) {
+    return static_cast<int>(std::upper_bound(DIST_BASE, DIST_BASE + 30, distance) - DIST_BASE) - 1;
+}
+
+// Adler-32 of two consecutive buffers from the checksums of each, as zlib's
+// adler32_combine computes it.
+uint32_t ParallelDeflate::CombineAdler(uint32_t first, uint32_t second, size_t secondSize) {
+    constexpr uint32_t BASE = 65521;
+    const uint32_t remainder = static_cast<uint32_t>(secondSize % BASE);
+    uint32_t sum1 = first & 0xFFFF;
+    uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % BASE);
+    sum1 += (second & 0xFFFF) + BASE - 1;
+    sum2 += (first >> 16) + (second >> 16) + BASE - remainder;
+    if (sum1 >= BASE)
+        sum1 -= BASE;
+    if (sum1 >= BASE)
+        sum1 -= BASE;
+    if (sum2 >= (BASE << 1))
+        sum2 -= (BASE << 1);
+    if (sum2 >= BASE)
+        sum2 -= BASE;
+    return sum1 | (sum2 << 16);
+}
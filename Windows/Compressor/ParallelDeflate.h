@@ -0,0 +1,39 @@
+#pragma once
+
+// pigz-style zlib compression. The input is cut into fixed-size pieces that
+// are deflated independently on a worker pool. Each piece is primed with the
+// 32 KiB of input before it, so matches still reach across piece boundaries,
+// and every piece but the last ends on a byte-aligned empty stored block so
+// the pieces concatenate into one valid stream.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+class ParallelDeflate {
+public:
+    // Appends a complete zlib stream (RFC 1950) of data to out. Pieces run on
+    // pool when one is given, otherwise one after another.
+    static void Compress(const uint8_t* data, size_t size, WorkerPool* pool, std::vector<uint8_t>& out);
+
+private:
+    // Match length 3-258, or 0 for a literal byte in value; value is the
+    // match distance otherwise.
+    struct Symbol {
+        uint16_t length;
+        uint16_t value;
+    };
+
+    class BitWriter;
+
+    static void CompressPiece(const uint8_t* data, size_t begin, size_t end, bool last, std::vector<uint8_t>& out);
+    static void WriteBlock(BitWriter& writer, const std::vector<Symbol>& symbols,
+        const uint8_t* raw, size_t rawSize, bool last);
+    static void BuildLengths(const uint32_t* freqs, int count, int maxBits, uint8_t* lengths);
+    static void AssignCodes(const uint8_t* lengths, int count, uint16_t* codes);
+    static int LengthCode(int length);
+    static int DistanceCode(int distance);
+    static uint32_t CombineAdler(uint32_t first, uint32_t second, size_t secondSize);
+};
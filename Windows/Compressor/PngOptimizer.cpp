@@ -0,0 +1,571 @@
+#include "PngOptimizer.h"
+#include "ImageEngine.h"
+#include "PaletteQuantizer.h"
+#include "PngWriter.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+extern "C" {
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+// zlib level for every trial. The png encoder exposes no other deflate
+// settings, and level 9 is smallest for practically every image, so trials
+// vary the pixel format and the row filter strategy instead.
+constexpr int PNG_COMPRESSION_LEVEL = 9;
+
+// Row filter strategies of the png encoder. "mixed" picks a filter per row.
+// 1-bit rows are rarely helped by prediction, so they only try the two ends.
+constexpr const char* PNG_FILTERS[] = { "none", "sub", "up", "avg", "paeth", "mixed" };
+constexpr const char* PNG_INDEXED_FILTERS[] = { "none", "mixed" };
+
+// Pictures whose filtered scanlines reach this size get a single trial
+// through PngWriter, which filters and deflates in parallel, instead of one
+// single-threaded encoder run per filter strategy. Palettes always go
+// through PngWriter: the png encoder writes all 256 PLTE entries.
+constexpr size_t PARALLEL_PNG_MIN_BYTES = 16 << 20;
+
+// Lossy PNG palette size and the mean weighted squared error per pixel it may
+// cost, at quality 1, 50, 75 and 100 (interpolated in between).
+constexpr int QUANTIZE_ANCHOR_QUALITY[4] = { 1, 50, 75, 100 };
+constexpr double QUANTIZE_COLORS[4] = { 16, 64, 128, 256 };
+constexpr double QUANTIZE_MAX_ERROR[4] = { 1000, 150, 60, 20 };
+
+bool PngOptimizer::Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (!desc)
+        return false;
+
+    // 16-bit pictures are narrowed when that is lossless, or when they are
+    // about to be quantised anyway; wide is kept only while it may be needed.
+    std::vector<AVFrame*> candidates;
+    Rgba16 wide;
+    Rgba8 image;
+    if (desc->comp[0].depth > 8) {
+        if (!Expand(frame, wide))
+            return false;
+
+        const PixelTraits traits = Analyze(wide);
+        if (traits.fits8 || options.quantizePng)
+            Narrow(wide, image);
+        if (traits.fits8)
+            wide.pixels = {};
+        else if (!options.quantizePng)
+            AddCandidates(frame, wide, traits, candidates);
+    }
+    else if (!Expand(frame, image)) {
+        return false;
+    }
+
+    if (!image.pixels.empty()) {
+        const PixelTraits traits = Analyze(image);
+        AVFrame* quantized = options.quantizePng ? Quantize(image, traits, options) : nullptr;
+        if (quantized) {
+            CopyDisplayInfo(frame, quantized);
+            candidates.push_back(quantized);
+        }
+        else if (!wide.pixels.empty()) {
+            image.pixels = {};
+            AddCandidates(frame, wide, Analyze(wide), candidates);
+        }
+        else {
+            AddCandidates(frame, image, traits, candidates);
+        }
+    }
+
+    // A null pred marks a PngWriter trial at the given bit depth. Palette and
+    // grey pictures that fit in fewer bits also try that packed depth.
+    struct Trial {
+        Trial(const AVFrame* picture, const char* pred, int depth) : picture(picture), pred(pred), depth(depth) {}
+
+        const AVFrame* picture;
+        const char* pred;
+        int depth;
+        std::vector<uint8_t> data;
+        bool ok = false;
+    };
+    std::vector<Trial> trials;
+    for (const AVFrame* picture : candidates) {
+        if (picture->format == AV_PIX_FMT_PAL8 || PngWriter::FilteredSize(picture) >= PARALLEL_PNG_MIN_BYTES) {
+            trials.emplace_back(picture, nullptr, 8);
+        }
+        else if (picture->format == AV_PIX_FMT_MONOBLACK) {
+            for (const char* pred : PNG_INDEXED_FILTERS)
+                trials.emplace_back(picture, pred, 8);
+        }
+        else {
+            for (const char* pred : PNG_FILTERS)
+                trials.emplace_back(picture, pred, 8);
+        }
+
+        const int depth = PngWriter::MinimumDepth(picture);
+        if (depth < 8)
+            trials.emplace_back(picture, nullptr, depth);
+    }
+
+    auto runTrial = [&trials, &options](size_t i) {
+        Trial& trial = trials[i];
+        trial.ok = trial.pred
+            ? EncodeTrial(trial.picture, trial.pred, trial.data)
+            : PngWriter::Write(trial.picture, options.pool, trial.data, trial.depth);
+    };
+    if (options.pool) {
+        options.pool->ParallelFor(trials.size(), runTrial);
+    }
+    else {
+        for (size_t i = 0; i < trials.size(); ++i)
+            runTrial(i);
+    }
+
+    Trial* best = nullptr;
+    for (auto& trial : trials) {
+        if (trial.ok && (!best || trial.data.size() < best->data.size()))
+            best = &trial;
+    }
+    if (best)
+        out = std::move(best->data);
+
+    for (AVFrame*& picture : candidates)
+        av_frame_free(&picture);
+    return best != nullptr;
+}
+
+// Formats the png decoder produces are unpacked directly; anything else goes
+// through swscale first.
+bool PngOptimizer::Expand(const AVFrame* frame, Rgba8& image) {
+    const AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+    AVFrame* converted = nullptr;
+    const AVFrame* src = frame;
+    if (format != AV_PIX_FMT_RGBA && format != AV_PIX_FMT_RGB24 && format != AV_PIX_FMT_GRAY8
+        && format != AV_PIX_FMT_YA8 && format != AV_PIX_FMT_PAL8) {
+        converted = av_frame_alloc();
+        if (!converted || !ImageEngine::Convert(frame, AV_PIX_FMT_RGBA, AVCOL_RANGE_UNSPECIFIED, 1, converted)) {
+            av_frame_free(&converted);
+            return false;
+        }
+        src = converted;
+    }
+
+    const int width = src->width;
+    image.width = width;
+    image.height = src->height;
+    image.pixels.resize(static_cast<size_t>(width) * src->height * 4);
+
+    const uint32_t* palette = reinterpret_cast<const uint32_t*>(src->data[1]);
+    for (int y = 0; y < src->height; ++y) {
+        const uint8_t* in = src->data[0] + static_cast<ptrdiff_t>(y) * src->linesize[0];
+        uint8_t* px = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+
+        switch (src->format) {
+        case AV_PIX_FMT_RGBA:
+            memcpy(px, in, static_cast<size_t>(width) * 4);
+            break;
+        case AV_PIX_FMT_RGB24:
+            for (int x = 0; x < width; ++x, px += 4, in += 3) {
+                px[0] = in[0];
+                px[1] = in[1];
+                px[2] = in[2];
+                px[3] = 255;
+            }
+            break;
+        case AV_PIX_FMT_GRAY8:
+            for (int x = 0; x < width; ++x, px += 4) {
+                px[0] = px[1] = px[2] = in[x];
+                px[3] = 255;
+            }
+            break;
+        case AV_PIX_FMT_YA8:
+            for (int x = 0; x < width; ++x, px += 4, in += 2) {
+                px[0] = px[1] = px[2] = in[0];
+                px[3] = in[1];
+            }
+            break;
+        case AV_PIX_FMT_PAL8:
+            for (int x = 0; x < width; ++x, px += 4) {
+                const uint32_t color = palette[in[x]];
+                px[0] = static_cast<uint8_t>(color >> 16);
+                px[1] = static_cast<uint8_t>(color >> 8);
+                px[2] = static_cast<uint8_t>(color);
+                px[3] = static_cast<uint8_t>(color >> 24);
+            }
+            break;
+        }
+    }
+
+    av_frame_free(&converted);
+    return true;
+}
+
+bool PngOptimizer::Expand(const AVFrame* frame, Rgba16& image) {
+    const AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+    AVFrame* converted = nullptr;
+    const AVFrame* src = frame;
+    if (format != AV_PIX_FMT_RGBA64BE && format != AV_PIX_FMT_RGB48BE
+        && format != AV_PIX_FMT_GRAY16BE && format != AV_PIX_FMT_YA16BE) {
+        converted = av_frame_alloc();
+        if (!converted || !ImageEngine::Convert(frame, AV_PIX_FMT_RGBA64BE, AVCOL_RANGE_UNSPECIFIED, 1, converted)) {
+            av_frame_free(&converted);
+            return false;
+        }
+        src = converted;
+    }
+
+    const int width = src->width;
+    image.width = width;
+    image.height = src->height;
+    image.pixels.resize(static_cast<size_t>(width) * src->height * 4);
+
+    for (int y = 0; y < src->height; ++y) {
+        const uint8_t* in = src->data[0] + static_cast<ptrdiff_t>(y) * src->linesize[0];
+        uint16_t* px = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+
+        switch (src->format) {
+        case AV_PIX_FMT_RGBA64BE:
+            for (int x = 0; x < width * 4; ++x)
+                px[x] = AV_RB16(in + x * 2);
+            break;
+        case AV_PIX_FMT_RGB48BE:
+            for (int x = 0; x < width; ++x, px += 4, in += 6) {
+                px[0] = AV_RB16(in);
+                px[1] = AV_RB16(in + 2);
+                px[2] = AV_RB16(in + 4);
+                px[3] = 0xFFFF;
+            }
+            break;
+        case AV_PIX_FMT_GRAY16BE:
+            for (int x = 0; x < width; ++x, px += 4, in += 2) {
+                px[0] = px[1] = px[2] = AV_RB16(in);
+                px[3] = 0xFFFF;
+            }
+            break;
+        case AV_PIX_FMT_YA16BE:
+            for (int x = 0; x < width; ++x, px += 4, in += 4) {
+                px[0] = px[1] = px[2] = AV_RB16(in);
+                px[3] = AV_RB16(in + 2);
+            }
+            break;
+        }
+    }
+
+    av_frame_free(&converted);
+    return true;
+}
+
+template <typename Sample>
+PngOptimizer::PixelTraits PngOptimizer::Analyze(const RgbaImage<Sample>& image) {
+    constexpr Sample maxValue = std::numeric_limits<Sample>::max();
+
+    PixelTraits traits;
+    const Sample* px = image.pixels.data();
+    const size_t count = image.pixels.size();
+    for (size_t i = 0; i < count; i += 4) {
+        const Sample r = px[i], g = px[i + 1], b = px[i + 2], a = px[i + 3];
+        if (a != maxValue)
+            traits.opaque = false;
+        if (r != g || g != b)
+            traits.gray = false;
+        if (r != 0 && r != maxValue)
+            traits.bilevel = false;
+        if constexpr (sizeof(Sample) > 1) {
+            if (r % 257 || g % 257 || b % 257 || a % 257)
+                traits.fits8 = false;
+        }
+        if (!traits.opaque && !traits.gray && (sizeof(Sample) == 1 || !traits.fits8))
+            break;
+    }
+    traits.bilevel = traits.bilevel && traits.gray && traits.opaque;
+    return traits;
+}
+
+// Rounds to the nearest 8-bit sample, which is exact when Analyze reported
+// fits8.
+void PngOptimizer::Narrow(const Rgba16& wide, Rgba8& image) {
+    image.width = wide.width;
+    image.height = wide.height;
+    image.pixels.resize(wide.pixels.size());
+    for (size_t i = 0; i < wide.pixels.size(); ++i)
+        image.pixels[i] = static_cast<uint8_t>((wide.pixels[i] * 255u + 32767u) / 65535u);
+}
+
+// The narrowest true-colour format holding the picture, plus a palette when
+// it has at most 256 colours.
+void PngOptimizer::AddCandidates(const AVFrame* source, const Rgba8& image, const PixelTraits& traits,
+    std::vector<AVFrame*>& candidates) {
+    AVPixelFormat format;
+    if (traits.bilevel)
+        format = AV_PIX_FMT_MONOBLACK;
+    else if (traits.gray)
+        format = traits.opaque ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YA8;
+    else
+        format = traits.opaque ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA;
+
+    AVFrame* pictures[2] = { Pack(image, format), traits.bilevel ? nullptr : PackPalette(image) };
+    for (AVFrame* picture : pictures) {
+        if (!picture)
+            continue;
+        CopyDisplayInfo(source, picture);
+        candidates.push_back(picture);
+    }
+}
+
+void PngOptimizer::AddCandidates(const AVFrame* source, const Rgba16& image, const PixelTraits& traits,
+    std::vector<AVFrame*>& candidates) {
+    AVPixelFormat format;
+    if (traits.gray)
+        format = traits.opaque ? AV_PIX_FMT_GRAY16BE : AV_PIX_FMT_YA16BE;
+    else
+        format = traits.opaque ? AV_PIX_FMT_RGB48BE : AV_PIX_FMT_RGBA64BE;
+
+    AVFrame* picture = Pack(image, format);
+    if (!picture)
+        return;
+    CopyDisplayInfo(source, picture);
+    candidates.push_back(picture);
+}
+
+AVFrame* PngOptimizer::Pack(const Rgba8& image, AVPixelFormat format) {
+    AVFrame* picture = NewPicture(image.width, image.height, format);
+    if (!picture)
+        return nullptr;
+
+    const int width = image.width;
+    for (int y = 0; y < image.height; ++y) {
+        const uint8_t* px = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+        uint8_t* out = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+
+        switch (format) {
+        case AV_PIX_FMT_RGBA:
+            memcpy(out, px, static_cast<size_t>(width) * 4);
+            break;
+        case AV_PIX_FMT_RGB24:
+            for (int x = 0; x < width; ++x, px += 4, out += 3) {
+                out[0] = px[0];
+                out[1] = px[1];
+                out[2] = px[2];
+            }
+            break;
+        case AV_PIX_FMT_GRAY8:
+            for (int x = 0; x < width; ++x, px += 4)
+                out[x] = px[0];
+            break;
+        case AV_PIX_FMT_YA8:
+            for (int x = 0; x < width; ++x, px += 4, out += 2) {
+                out[0] = px[0];
+                out[1] = px[3];
+            }
+            break;
+        case AV_PIX_FMT_MONOBLACK:
+            memset(out, 0, (static_cast<size_t>(width) + 7) / 8);
+            for (int x = 0; x < width; ++x, px += 4) {
+                if (px[0])
+                    out[x >> 3] |= 0x80 >> (x & 7);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return picture;
+}
+
+AVFrame* PngOptimizer::Pack(const Rgba16& image, AVPixelFormat format) {
+    AVFrame* picture = NewPicture(image.width, image.height, format);
+    if (!picture)
+        return nullptr;
+
+    const int width = image.width;
+    for (int y = 0; y < image.height; ++y) {
+        const uint16_t* px = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+        uint8_t* out = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+
+        switch (format) {
+        case AV_PIX_FMT_RGBA64BE:
+            for (int x = 0; x < width * 4; ++x)
+                AV_WB16(out + x * 2, px[x]);
+            break;
+        case AV_PIX_FMT_RGB48BE:
+            for (int x = 0; x < width; ++x, px += 4, out += 6) {
+                AV_WB16(out, px[0]);
+                AV_WB16(out + 2, px[1]);
+                AV_WB16(out + 4, px[2]);
+            }
+            break;
+        case AV_PIX_FMT_GRAY16BE:
+            for (int x = 0; x < width; ++x, px += 4, out += 2)
+                AV_WB16(out, px[0]);
+            break;
+        case AV_PIX_FMT_YA16BE:
+            for (int x = 0; x < width; ++x, px += 4, out += 4) {
+                AV_WB16(out, px[0]);
+                AV_WB16(out + 2, px[3]);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return picture;
+}
+
+// Exact palette, most frequent colour first; nullptr above 256 colours.
+// PngWriter trims PLTE to the entries in use, and the unused ones are opaque
+// so they never extend tRNS.
+AVFrame* PngOptimizer::PackPalette(const Rgba8& image) {
+    auto argb = [](const uint8_t* px) {
+        return (static_cast<uint32_t>(px[3]) << 24) | (static_cast<uint32_t>(px[0]) << 16)
+            | (static_cast<uint32_t>(px[1]) << 8) | px[2];
+    };
+
+    std::unordered_map<uint32_t, uint32_t> counts;
+    if (!CountColors(image, 256, counts))
+        return nullptr;
+
+    std::vector<std::pair<uint32_t, uint32_t>> colors(counts.begin(), counts.end());
+    std::sort(colors.begin(), colors.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+
+    AVFrame* picture = NewPicture(image.width, image.height, AV_PIX_FMT_PAL8);
+    if (!picture)
+        return nullptr;
+
+    uint32_t* palette = reinterpret_cast<uint32_t*>(picture->data[1]);
+    std::unordered_map<uint32_t, uint8_t> indices;
+    for (int i = 0; i < 256; ++i)
+        palette[i] = 0xFF000000;
+    for (size_t i = 0; i < colors.size(); ++i) {
+        palette[i] = colors[i].first;
+        indices[colors[i].first] = static_cast<uint8_t>(i);
+    }
+
+    const int width = image.width;
+    for (int y = 0; y < image.height; ++y) {
+        const uint8_t* px = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+        uint8_t* out = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+        uint32_t lastColor = argb(px);
+        uint8_t lastIndex = indices[lastColor];
+        for (int x = 0; x < width; ++x, px += 4) {
+            const uint32_t color = argb(px);
+            if (color != lastColor) {
+                lastColor = color;
+                lastIndex = indices[color];
+            }
+            out[x] = lastIndex;
+        }
+    }
+    return picture;
+}
+
+// Lossy palette for image, or nullptr when it would not pay off: 1-bit and
+// pictures whose exact colours already fit the quality's palette size stay
+// lossless, as do those the quantiser cannot fit into the error budget.
+AVFrame* PngOptimizer::Quantize(const Rgba8& image, const PixelTraits& traits, const ImageOptions& options) {
+    QuantizeOptions quantize;
+    quantize.maxColors = static_cast<int>(std::lround(QualityAnchor(options.quality, QUANTIZE_COLORS)));
+    quantize.maxError = QualityAnchor(options.quality, QUANTIZE_MAX_ERROR);
+    quantize.dither = options.dither;
+
+    std::unordered_map<uint32_t, uint32_t> counts;
+    if (traits.bilevel || CountColors(image, static_cast<size_t>(quantize.maxColors), counts))
+        return nullptr;
+
+    AVFrame* picture = NewPicture(image.width, image.height, AV_PIX_FMT_PAL8);
+    if (!picture)
+        return nullptr;
+
+    uint32_t* palette = reinterpret_cast<uint32_t*>(picture->data[1]);
+    std::fill(palette, palette + 256, 0xFF000000);
+    std::vector<uint8_t> indices(static_cast<size_t>(image.width) * image.height);
+    int paletteSize = 0;
+    if (!PaletteQuantizer::Quantize(image.pixels.data(), image.width, image.height, quantize,
+        palette, paletteSize, indices.data())) {
+        av_frame_free(&picture);
+        return nullptr;
+    }
+
+    for (int y = 0; y < image.height; ++y) {
+        memcpy(picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0],
+            indices.data() + static_cast<size_t>(y) * image.width, image.width);
+    }
+    return picture;
+}
+
+// Counts pixels per 0xAARRGGBB colour; false as soon as there are more than
+// limit colours.
+bool PngOptimizer::CountColors(const Rgba8& image, size_t limit, std::unordered_map<uint32_t, uint32_t>& counts) {
+    uint32_t last = 0;
+    uint32_t* lastCount = nullptr;
+    for (size_t i = 0; i < image.pixels.size(); i += 4) {
+        const uint8_t* px = &image.pixels[i];
+        const uint32_t color = (static_cast<uint32_t>(px[3]) << 24) | (static_cast<uint32_t>(px[0]) << 16)
+            | (static_cast<uint32_t>(px[1]) << 8) | px[2];
+        if (lastCount && color == last) {
+            ++*lastCount;
+            continue;
+        }
+        auto [it, inserted] = counts.try_emplace(color, 0);
+        if (inserted && counts.size() > limit)
+            return false;
+        ++it->second;
+        last = color;
+        lastCount = &it->second;
+    }
+    return true;
+}
+
+// Linear interpolation between the values at QUANTIZE_ANCHOR_QUALITY.
+double PngOptimizer::QualityAnchor(int quality, const double (&values)[4]) {
+    quality = std::clamp(quality, QUANTIZE_ANCHOR_QUALITY[0], QUANTIZE_ANCHOR_QUALITY[3]);
+    for (int i = 1; i < 4; ++i) {
+        if (quality <= QUANTIZE_ANCHOR_QUALITY[i]) {
+            const double t = static_cast<double>(quality - QUANTIZE_ANCHOR_QUALITY[i - 1])
+                / (QUANTIZE_ANCHOR_QUALITY[i] - QUANTIZE_ANCHOR_QUALITY[i - 1]);
+            return values[i - 1] + (values[i] - values[i - 1]) * t;
+        }
+    }
+    return values[3];
+}
+
+AVFrame* PngOptimizer::NewPicture(int width, int height, AVPixelFormat format) {
+    AVFrame* picture = av_frame_alloc();
+    if (!picture)
+        return nullptr;
+
+    picture->format = format;
+    picture->width = width;
+    picture->height = height;
+    if (av_frame_get_buffer(picture, 0) < 0)
+        av_frame_free(&picture);
+    return picture;
+}
+
+// Colour tags and the ICC profile decide how the pixels look, so they are
+// kept; text, time, EXIF and physical size chunks are left behind.
+void PngOptimizer::CopyDisplayInfo(const AVFrame* source, AVFrame* picture) {
+    picture->color_primaries = source->color_primaries;
+    picture->color_trc = source->color_trc;
+
+    const AVFrameSideData* icc = av_frame_get_side_data(source, AV_FRAME_DATA_ICC_PROFILE);
+    if (!icc)
+        return;
+    AVFrameSideData* copy = av_frame_new_side_data(picture, AV_FRAME_DATA_ICC_PROFILE, icc->size);
+    if (copy)
+        memcpy(copy->data, icc->data, icc->size);
+}
+
+bool PngOptimizer::EncodeTrial(const AVFrame* picture, const char* pred, std::vector<uint8_t>& out) {
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!encoder)
+        return false;
+
+    return ImageEngine::RunEncoder(encoder, picture, [pred](AVCodecContext* encCtx) {
+        encCtx->compression_level = PNG_COMPRESSION_LEVEL;
+        av_opt_set(encCtx->priv_data, "pred", pred, 0);
+        }, out);
+}
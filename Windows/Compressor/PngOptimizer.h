@@ -0,0 +1,66 @@
+#pragma once
+
+// Lossless PNG re-encoding. A picture is first reduced to the smallest pixel
+// formats that still hold it exactly (8-bit samples, grey, no alpha, palette,
+// 1-bit), then each candidate is encoded with every row filter strategy and
+// the smallest file is kept. Only chunks that change how the pixels display
+// (colour tags and the ICC profile) are carried over from the source.
+// Optionally, pictures are first quantised to a palette (lossy), falling back
+// to the lossless candidates when the quality's error budget is exceeded.
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+struct ImageOptions;
+
+class PngOptimizer {
+public:
+    // Trials run on options.pool when one is given, otherwise one after
+    // another. options.quantizePng enables the lossy palette.
+    static bool Encode(const AVFrame* frame, const ImageOptions& options, std::vector<uint8_t>& out);
+
+private:
+    // Interleaved R, G, B, A samples, width * height * 4 of them.
+    template <typename Sample>
+    struct RgbaImage {
+        int width = 0;
+        int height = 0;
+        std::vector<Sample> pixels;
+    };
+    using Rgba8 = RgbaImage<uint8_t>;
+    using Rgba16 = RgbaImage<uint16_t>;
+
+    struct PixelTraits {
+        bool opaque = true;
+        bool gray = true;
+        bool bilevel = true;  // Opaque grey that is only black and white
+        bool fits8 = true;    // Every 16-bit sample is an 8-bit one times 257
+    };
+
+    static bool Expand(const AVFrame* frame, Rgba8& image);
+    static bool Expand(const AVFrame* frame, Rgba16& image);
+    template <typename Sample>
+    static PixelTraits Analyze(const RgbaImage<Sample>& image);
+    static void Narrow(const Rgba16& wide, Rgba8& image);
+
+    static void AddCandidates(const AVFrame* source, const Rgba8& image, const PixelTraits& traits,
+        std::vector<AVFrame*>& candidates);
+    static void AddCandidates(const AVFrame* source, const Rgba16& image, const PixelTraits& traits,
+        std::vector<AVFrame*>& candidates);
+    static AVFrame* Pack(const Rgba8& image, AVPixelFormat format);
+    static AVFrame* Pack(const Rgba16& image, AVPixelFormat format);
+    static AVFrame* PackPalette(const Rgba8& image);
+    static AVFrame* Quantize(const Rgba8& image, const PixelTraits& traits, const ImageOptions& options);
+    static bool CountColors(const Rgba8& image, size_t limit, std::unordered_map<uint32_t, uint32_t>& counts);
+    static double QualityAnchor(int quality, const double (&values)[4]);
+    static AVFrame* NewPicture(int width, int height, AVPixelFormat format);
+    static void CopyDisplayInfo(const AVFrame* source, AVFrame* picture);
+
+    static bool EncodeTrial(const AVFrame* picture, const char* pred, std::vector<uint8_t>& out);
+};
@@ -0,0 +1,273 @@
+#include "PngWriter.h"
+#include "ParallelDeflate.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+}
+
+// Rows filtered per pool job, and the largest IDAT chunk written.
+constexpr int FILTER_BATCH_ROWS = 64;
+constexpr size_t PNG_IDAT_SIZE = 1 << 20;
+
+constexpr int PNG_COLOR_GRAY = 0;
+constexpr int PNG_COLOR_RGB = 2;
+constexpr int PNG_COLOR_PALETTE = 3;
+constexpr int PNG_COLOR_GRAY_ALPHA = 4;
+constexpr int PNG_COLOR_RGBA = 6;
+
+bool PngWriter::Write(const AVFrame* picture, WorkerPool* pool, std::vector<uint8_t>& out, int packedDepth) {
+    int bitDepth, colorType, bitsPerPixel;
+    if (!Describe(picture->format, bitDepth, colorType, bitsPerPixel))
+        return false;
+
+    // Packed grey keeps the top of the range: 8-bit white is 255 / divisor.
+    const bool packed = (picture->format == AV_PIX_FMT_PAL8 || picture->format == AV_PIX_FMT_GRAY8) &&
+        (packedDepth == 1 || packedDepth == 2 || packedDepth == 4);
+    int divisor = 1;
+    if (packed) {
+        bitDepth = bitsPerPixel = packedDepth;
+        if (colorType == PNG_COLOR_GRAY)
+            divisor = 255 / ((1 << packedDepth) - 1);
+    }
+
+    const int height = picture->height;
+    const size_t rowBytes = (static_cast<size_t>(picture->width) * bitsPerPixel + 7) / 8;
+    const int bpp = std::max(1, bitsPerPixel / 8);
+    const bool adaptive = colorType != PNG_COLOR_PALETTE && bitDepth >= 8;
+
+    std::vector<uint8_t> filtered(static_cast<size_t>(height) * (rowBytes + 1));
+    auto filterBatch = [&](size_t batch) {
+        const int first = static_cast<int>(batch) * FILTER_BATCH_ROWS;
+        const int last = std::min(height, first + FILTER_BATCH_ROWS);
+        std::vector<uint8_t> packedRow(packed ? rowBytes : 0);
+        for (int y = first; y < last; ++y) {
+            const uint8_t* row = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+            const uint8_t* above = y > 0 ? row - picture->linesize[0] : nullptr;
+            // Sub-byte rows are never predicted, so the row above is not needed
+            if (packed) {
+                PackRow(row, picture->width, bitDepth, divisor, packedRow.data());
+                row = packedRow.data();
+                above = nullptr;
+            }
+            FilterRow(row, above, rowBytes, bpp, adaptive, filtered.data() + static_cast<size_t>(y) * (rowBytes + 1));
+        }
+    };
+    const size_t batches = (static_cast<size_t>(height) + FILTER_BATCH_ROWS - 1) / FILTER_BATCH_ROWS;
+    if (pool) {
+        pool->ParallelFor(batches, filterBatch);
+    }
+    else {
+        for (size_t i = 0; i < batches; ++i)
+            filterBatch(i);
+    }
+
+    std::vector<uint8_t> compressed;
+    ParallelDeflate::Compress(filtered.data(), filtered.size(), pool, compressed);
+    filtered = {};
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.assign(signature, signature + sizeof(signature));
+
+    uint8_t header[13] = {};
+    AV_WB32(header, static_cast<uint32_t>(picture->width));
+    AV_WB32(header + 4, static_cast<uint32_t>(height));
+    header[8] = static_cast<uint8_t>(bitDepth);
+    header[9] = static_cast<uint8_t>(colorType);
+    WriteChunk(out, "IHDR", header, sizeof(header));
+
+    WriteColorChunks(picture, out);
+    if (colorType == PNG_COLOR_PALETTE)
+        WritePaletteChunks(picture, out);
+
+    for (size_t offset = 0; offset < compressed.size(); offset += PNG_IDAT_SIZE)
+        WriteChunk(out, "IDAT", compressed.data() + offset, std::min(PNG_IDAT_SIZE, compressed.size() - offset));
+    WriteChunk(out, "IEND", nullptr, 0);
+    return true;
+}
+
+size_t PngWriter::FilteredSize(const AVFrame* picture) {
+    int bitDepth, colorType, bitsPerPixel;
+    if (!Describe(picture->format, bitDepth, colorType, bitsPerPixel))
+        return 0;
+    const size_t rowBytes = (static_cast<size_t>(picture->width) * bitsPerPixel + 7) / 8;
+    return static_cast<size_t>(picture->height) * (rowBytes + 1);
+}
+
+int PngWriter::MinimumDepth(const AVFrame* picture) {
+    if (picture->format == AV_PIX_FMT_PAL8) {
+        int used = 0;
+        for (int y = 0; y < picture->height && used < 16; ++y) {
+            const uint8_t* row = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+            used = std::max(used, *std::max_element(row, row + picture->width) + 1);
+        }
+        return used <= 2 ? 1 : used <= 4 ? 2 : used <= 16 ? 4 : 8;
+    }
+
+    if (picture->format == AV_PIX_FMT_GRAY8) {
+        // Grey levels a depth can hold are multiples of 255, 85 and 17
+        bool fits[3] = { true, true, true };
+        for (int y = 0; y < picture->height && fits[2]; ++y) {
+            const uint8_t* row = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+            for (int x = 0; x < picture->width; ++x) {
+                fits[0] = fits[0] && row[x] % 255 == 0;
+                fits[1] = fits[1] && row[x] % 85 == 0;
+                fits[2] = fits[2] && row[x] % 17 == 0;
+            }
+        }
+        return fits[0] ? 1 : fits[1] ? 2 : fits[2] ? 4 : 8;
+    }
+    return 8;
+}
+
+// 16-bit formats are the big-endian ones, which is PNG's own sample order.
+bool PngWriter::Describe(int format, int& bitDepth, int& colorType, int& bitsPerPixel) {
+    switch (format) {
+    case AV_PIX_FMT_MONOBLACK: bitDepth = 1;  colorType = PNG_COLOR_GRAY;       bitsPerPixel = 1;  return true;
+    case AV_PIX_FMT_GRAY8:     bitDepth = 8;  colorType = PNG_COLOR_GRAY;       bitsPerPixel = 8;  return true;
+    case AV_PIX_FMT_YA8:       bitDepth = 8;  colorType = PNG_COLOR_GRAY_ALPHA; bitsPerPixel = 16; return true;
+    case AV_PIX_FMT_RGB24:     bitDepth = 8;  colorType = PNG_COLOR_RGB;        bitsPerPixel = 24; return true;
+    case AV_PIX_FMT_RGBA:      bitDepth = 8;  colorType = PNG_COLOR_RGBA;       bitsPerPixel = 32; return true;
+    case AV_PIX_FMT_PAL8:      bitDepth = 8;  colorType = PNG_COLOR_PALETTE;    bitsPerPixel = 8;  return true;
+    case AV_PIX_FMT_GRAY16BE:  bitDepth = 16; colorType = PNG_COLOR_GRAY;       bitsPerPixel = 16; return true;
+    case AV_PIX_FMT_YA16BE:    bitDepth = 16; colorType = PNG_COLOR_GRAY_ALPHA; bitsPerPixel = 32; return true;
+    case AV_PIX_FMT_RGB48BE:   bitDepth = 16; colorType = PNG_COLOR_RGB;        bitsPerPixel = 48; return true;
+    case AV_PIX_FMT_RGBA64BE:  bitDepth = 16; colorType = PNG_COLOR_RGBA;       bitsPerPixel = 64; return true;
+    default:                   return false;
+    }
+}
+
+// Packs 8-bit samples, divided by divisor, most significant bits first.
+void PngWriter::PackRow(const uint8_t* samples, int width, int bitDepth, int divisor, uint8_t* out) {
+    const int perByte = 8 / bitDepth;
+    std::memset(out, 0, (static_cast<size_t>(width) * bitDepth + 7) / 8);
+    for (int x = 0; x < width; ++x) {
+        const int shift = 8 - bitDepth * (x % perByte + 1);
+        out[x / perByte] |= static_cast<uint8_t>((samples[x] / divisor) << shift);
+    }
+}
+
+// Writes the filter type byte and the filtered row to out. above is the
+// previous unfiltered row, or nullptr for the first one.
+void PngWriter::FilterRow(const uint8_t* row, const uint8_t* above, size_t rowBytes, int bpp,
+    bool adaptive, uint8_t* out) {
+    auto residual = [&](int filter, size_t i) -> uint8_t {
+        const int a = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+        const int b = above ? above[i] : 0;
+        const int c = above && i >= static_cast<size_t>(bpp) ? above[i - bpp] : 0;
+        switch (filter) {
+        case 1: return static_cast<uint8_t>(row[i] - a);
+        case 2: return static_cast<uint8_t>(row[i] - b);
+        case 3: return static_cast<uint8_t>(row[i] - ((a + b) >> 1));
+        case 4: {
+            const int p = a + b - c;
+            const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            const int predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            return static_cast<uint8_t>(row[i] - predictor);
+        }
+        default: return row[i];
+        }
+    };
+
+    int best = 0;
+    if (adaptive) {
+        uint64_t bestSum = UINT64_MAX;
+        for (int filter = 0; filter < 5; ++filter) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < rowBytes && sum < bestSum; ++i)
+                sum += static_cast<uint64_t>(std::abs(static_cast<int8_t>(residual(filter, i))));
+            if (sum < bestSum) {
+                bestSum = sum;
+                best = filter;
+            }
+        }
+    }
+
+    out[0] = static_cast<uint8_t>(best);
+    for (size_t i = 0; i < rowBytes; ++i)
+        out[i + 1] = residual(best, i);
+}
+
+// An ICC profile wins over the colour tags; otherwise sRGB or plain gamma is
+// recorded when the source said so.
+void PngWriter::WriteColorChunks(const AVFrame* picture, std::vector<uint8_t>& out) {
+    const AVFrameSideData* icc = av_frame_get_side_data(picture, AV_FRAME_DATA_ICC_PROFILE);
+    if (icc) {
+        static const char name[] = "ICC profile";
+        std::vector<uint8_t> data(name, name + sizeof(name));
+        data.push_back(0);
+        ParallelDeflate::Compress(icc->data, icc->size, nullptr, data);
+        WriteChunk(out, "iCCP", data.data(), data.size());
+        return;
+    }
+
+    if (picture->color_trc == AVCOL_TRC_IEC61966_2_1) {
+        const uint8_t perceptual = 0;
+        WriteChunk(out, "sRGB", &perceptual, 1);
+        return;
+    }
+
+    uint32_t gamma = 0;
+    if (picture->color_trc == AVCOL_TRC_GAMMA22)
+        gamma = 45455;
+    else if (picture->color_trc == AVCOL_TRC_GAMMA28)
+        gamma = 35714;
+    else if (picture->color_trc == AVCOL_TRC_LINEAR)
+        gamma = 100000;
+    if (gamma) {
+        uint8_t data[4];
+        AV_WB32(data, gamma);
+        WriteChunk(out, "gAMA", data, sizeof(data));
+    }
+}
+
+// PLTE holds only the entries some pixel uses, and tRNS stops at the last
+// entry that is not opaque.
+void PngWriter::WritePaletteChunks(const AVFrame* picture, std::vector<uint8_t>& out) {
+    int used = 0;
+    for (int y = 0; y < picture->height && used < 256; ++y) {
+        const uint8_t* row = picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0];
+        used = std::max(used, *std::max_element(row, row + picture->width) + 1);
+    }
+
+    const uint32_t* palette = reinterpret_cast<const uint32_t*>(picture->data[1]);
+    std::vector<uint8_t> colors;
+    int transparent = 0;
+    for (int i = 0; i < used; ++i) {
+        colors.push_back(static_cast<uint8_t>(palette[i] >> 16));
+        colors.push_back(static_cast<uint8_t>(palette[i] >> 8));
+        colors.push_back(static_cast<uint8_t>(palette[i]));
+        if ((palette[i] >> 24) != 0xFF)
+            transparent = i + 1;
+    }
+    WriteChunk(out, "PLTE", colors.data(), colors.size());
+
+    if (transparent > 0) {
+        std::vector<uint8_t> alpha;
+        for (int i = 0; i < transparent; ++i)
+            alpha.push_back(static_cast<uint8_t>(palette[i] >> 24));
+        WriteChunk(out, "tRNS", alpha.data(), alpha.size());
+    }
+}
+
+void PngWriter::WriteChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+    uint8_t length[4];
+    AV_WB32(length, static_cast<uint32_t>(size));
+    out.insert(out.end(), length, length + 4);
+
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (size > 0)
+        out.insert(out.end(), data, data + size);
+
+    const AVCRC* table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    const uint32_t crc = av_crc(table, 0xFFFFFFFF, out.data() + start, out.size() - start) ^ 0xFFFFFFFF;
+    uint8_t checksum[4];
+    AV_WB32(checksum, crc);
+    out.insert(out.end(), checksum, checksum + 4);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// PNG container writer for very large pictures, where a single zlib stream
+// is the bottleneck: rows are filtered and deflated in parallel through
+// ParallelDeflate. Handles the pixel formats PngOptimizer produces, and is
+// also its palette writer, since it trims PLTE and tRNS to the entries in
+// use and packs palette and grey samples below 8 bits.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+class WorkerPool;
+
+class PngWriter {
+public:
+    // Each row gets the filter with the smallest sum of absolute residuals,
+    // except palette and sub-byte rows, which stay unfiltered. PAL8 and GRAY8
+    // pictures are written at packedDepth when it is 1, 2 or 4, which must be
+    // at least MinimumDepth. Work runs on pool when one is given.
+    static bool Write(const AVFrame* picture, WorkerPool* pool, std::vector<uint8_t>& out, int packedDepth = 8);
+
+    // Smallest bit depth (1, 2, 4 or 8) holding a PAL8 or GRAY8 picture
+    // exactly; 8 for other formats.
+    static int MinimumDepth(const AVFrame* picture);
+
+    // Size of the scanline data a picture filters to, filter bytes included;
+    // 0 for formats Write does not handle.
+    static size_t FilteredSize(const AVFrame* picture);
+
+private:
+    static bool Describe(int format, int& bitDepth, int& colorType, int& bitsPerPixel);
+    static void PackRow(const uint8_t* samples, int width, int bitDepth, int divisor, uint8_t* out);
+    static void FilterRow(const uint8_t* row, const uint8_t* above, size_t rowBytes, int bpp,
+        bool adaptive, uint8_t* out);
+    static void WriteColorChunks(const AVFrame* picture, std::vector<uint8_t>& out);
+    static void WritePaletteChunks(const AVFrame* picture, std::vector<uint8_t>& out);
+    static void WriteChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size);
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling jobs from a shared FIFO queue.
+class WorkerPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    bool stopping = false;
+
+    void WorkerLoop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    // A thread count of 0 sizes the pool from the number of hardware threads.
+    explicit WorkerPool(unsigned threadCount = 0) {
+        if (threadCount == 0)
+            threadCount = DefaultSize();
+        workers.reserve(threadCount);
+        for (unsigned i = 0; i < threadCount; ++i)
+            workers.emplace_back([this]() { WorkerLoop(); });
+    }
+
+    // Pending jobs are dropped; jobs already running are waited for.
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+            jobs.clear();
+        }
+        jobReady.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void Submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobs.push_back(std::move(job));
+        }
+        jobReady.notify_one();
+    }
+
+    // Runs job(0) .. job(count - 1) across the pool and returns once all of
+    // them have finished. The calling thread claims indices as well, so a job
+    // already running on the pool can fan out without waiting on workers that
+    // may all be busy: once every index is claimed, only running calls remain.
+    void ParallelFor(size_t count, std::function<void(size_t)> job) {
+        if (count == 0)
+            return;
+
+        struct Batch {
+            std::function<void(size_t)> job;
+            size_t count = 0;
+            std::atomic<size_t> next{ 0 };
+            std::atomic<size_t> finished{ 0 };
+        };
+        auto batch = std::make_shared<Batch>();
+        batch->job = std::move(job);
+        batch->count = count;
+
+        auto drain = [](Batch& b) {
+            for (size_t i = b.next.fetch_add(1); i < b.count; i = b.next.fetch_add(1)) {
+                b.job(i);
+                if (b.finished.fetch_add(1) + 1 == b.count)
+                    b.finished.notify_all();
+            }
+        };
+
+        const size_t helpers = std::min<size_t>(count - 1, workers.size());
+        for (size_t i = 0; i < helpers; ++i)
+            Submit([batch, drain]() { drain(*batch); });
+
+        drain(*batch);
+        for (size_t done = batch->finished.load(); done < count; done = batch->finished.load())
+            batch->finished.wait(done);
+    }
+
+    unsigned Size() const {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    static unsigned DefaultSize() {
+        const unsigned hw = std::thread::hardware_concurrency();
+        return hw > 0 ? hw : 4;
+    }
+};